@@ -0,0 +1,335 @@
+/**
+ * capture.c -- Writes sent and received ICMP packets to pcap from a background thread
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+
+#define PCAP_IMPL
+#include "pcap.h"
+
+#include "capture.h"
+#include "iputils.h"
+#include "spsc_ring.h"
+
+#define CAPTURE_RING (8 * 1024 * 1024)	/* A few seconds of 64k packets if the disk stalls */
+#define CAPTURE_IDLE_MS 10		/* Writer sleep when the ring is empty */
+#define CAPTURE_SNAPLEN 65535
+
+/* What sits in the ring ahead of each packet */
+struct capture_rec {
+	uint64_t ts_ns;
+	uint32_t caplen;
+	uint32_t orglen;
+};
+
+struct capture {
+	struct spsc_ring ring;
+	pcap_file_t* file;	/* NULL in history mode, only snapshots get written */
+	pcap_opts_t popts;
+	bool comments;	/* pcapng, describe each packet */
+	int run;
+	pthread_t thread;
+
+	/* History mode: the writer thread moves packets from ring into hist, dropping the oldest */
+	struct capture_opts opts;
+	struct spsc_ring hist;
+	char prefix[256];	/* Snapshot names are prefix-NNN.ext */
+	char ext[16];
+	int next_file;
+	int snap_pending;	/* Set by capture_snapshot, cleared by the thread once written */
+	uint64_t snap_due;	/* Monotonic ns to write the snapshot at */
+	char snap_reason[128];
+};
+
+/**
+ * One line about what a packet is, seq and target so it can be matched up with the ping output. NULL if it isn't ours.
+ * seq and id are shown in host order, undecoded: ping puts them on the wire unswapped and numbers its output the same
+ * way. traceroute puts its seq in network order, on a little endian host that one shows up byte swapped
+ */
+static const char* _capture_describe(const uint8_t* pkt, size_t len, char* buf, size_t n) {
+	const struct ip* ipf = (const struct ip*)pkt;
+	if (len < sizeof(*ipf) || len < ipf->ip_hl * 4u + ICMP_MINLEN || ipf->ip_p != IPPROTO_ICMP)
+		return NULL;
+	const struct icmp* icmp = (const struct icmp*)(pkt + ipf->ip_hl * 4);
+	char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &ipf->ip_src, src, sizeof(src));
+	inet_ntop(AF_INET, &ipf->ip_dst, dst, sizeof(dst));
+
+	switch (icmp->icmp_type) {
+	case ICMP_ECHO:
+		snprintf(buf, n, "echo request seq=%u id=0x%04x to %s ttl=%u", icmp->icmp_seq, icmp->icmp_id, dst, ipf->ip_ttl);
+		return buf;
+	case ICMP_ECHOREPLY:
+		snprintf(buf, n, "echo reply seq=%u id=0x%04x from %s", icmp->icmp_seq, icmp->icmp_id, src);
+		return buf;
+	case ICMP_TIMXCEED:
+	case ICMP_UNREACH: {
+		/* The error quotes the header of the probe that caused it */
+		const size_t off = ipf->ip_hl * 4 + ICMP_MINLEN;
+		const struct ip* q = (const struct ip*)(pkt + off);
+		if (len < off + sizeof(*q) || len < off + q->ip_hl * 4u + ICMP_MINLEN || q->ip_p != IPPROTO_ICMP)
+			return NULL;
+		const struct icmp* qi = (const struct icmp*)((const uint8_t*)q + q->ip_hl * 4);
+		inet_ntop(AF_INET, &q->ip_dst, dst, sizeof(dst));
+		snprintf(buf, n, "%s (code %u) from %s for seq=%u id=0x%04x to %s", icmp->icmp_type == ICMP_TIMXCEED ? "time exceeded" : "unreachable",
+			icmp->icmp_code, src, qi->icmp_seq, qi->icmp_id, dst);
+		return buf;
+	}
+	default:
+		return NULL;
+	}
+}
+
+static void _capture_write(struct capture* c, pcap_file_t* f, const struct capture_rec* rec) {
+	pcap_timestamp_t ts = {(uint32_t)(rec->ts_ns / 1000000000ULL), (uint32_t)(rec->ts_ns % 1000000000ULL)};
+	char comment[160];
+	const char* desc = c->comments ? _capture_describe((const uint8_t*)(rec + 1), rec->caplen, comment, sizeof(comment)) : NULL;
+	pcap_add_packet_comment(f, ts, rec + 1, rec->caplen, rec->orglen, desc);
+}
+
+/* Keep a packet in the history, pushing out whatever is too old or in the way */
+static void _capture_keep(struct capture* c, const struct capture_rec* rec, size_t len) {
+	const struct capture_rec* old;
+	size_t olen;
+	while ((old = spsc_ring_front(&c->hist, &olen)) && old->ts_ns + c->opts.history_ns < rec->ts_ns)
+		spsc_ring_release(&c->hist, olen);
+
+	void* p;
+	while (!(p = spsc_ring_reserve(&c->hist, len)) && spsc_ring_front(&c->hist, &olen))
+		spsc_ring_release(&c->hist, olen);
+	if (!p)
+		return;
+	memcpy(p, rec, len);
+	spsc_ring_commit(&c->hist);
+}
+
+/* Everything in the history goes into the next file of the rotation */
+static void _capture_dump(struct capture* c) {
+	char path[sizeof(c->prefix) + sizeof(c->ext) + 8];
+	snprintf(path, sizeof(path), "%s-%03d%s", c->prefix, c->next_file, c->ext);
+	c->next_file = (c->next_file + 1) % c->opts.max_files;
+
+	pcap_file_t* f = pcap_file_create_opts(path, PCAP_LLT_RAWIP4, &c->popts);
+	if (!f) {
+		printf("Unable to create %s: %s\n", path, strerror(errno));
+		return;
+	}
+	uint64_t pos = c->hist.tail, first = 0, last = 0, count = 0;
+	size_t len;
+	const struct capture_rec* rec;
+	while ((rec = spsc_ring_peek(&c->hist, &pos, &len))) {
+		_capture_write(c, f, rec);
+		first = first ? first : rec->ts_ns;
+		last = rec->ts_ns;
+		++count;
+	}
+	pcap_file_close(f);
+
+	char b[128];
+	printf("[%s] %s: saved %llu packets (%.1f s) to %s\n", time_now_str(b, sizeof(b)), c->snap_reason,
+		(unsigned long long)count, (last - first) / 1e9, path);
+}
+
+static size_t _capture_drain(struct capture* c) {
+	size_t count = 0, len;
+	const void* p;
+	while ((p = spsc_ring_front(&c->ring, &len))) {
+		if (c->file)
+			_capture_write(c, c->file, (const struct capture_rec*)p);
+		else
+			_capture_keep(c, (const struct capture_rec*)p, len);
+		spsc_ring_release(&c->ring, len);
+		++count;
+	}
+	return count;
+}
+
+static void* _capture_thread(void* arg) {
+	struct capture* c = (struct capture*)arg;
+	while (__atomic_load_n(&c->run, __ATOMIC_ACQUIRE)) {
+		if (_capture_drain(c))
+			continue;
+		if (__atomic_load_n(&c->snap_pending, __ATOMIC_ACQUIRE) && time_now_ns() >= c->snap_due) {
+			_capture_dump(c);
+			__atomic_store_n(&c->snap_pending, 0, __ATOMIC_RELEASE);
+		}
+		/* Idle, push what we have to disk so the file is never far behind */
+		if (c->file)
+			pcap_file_flush(c->file);
+		struct timespec ts = {0, CAPTURE_IDLE_MS * 1000000L};
+		nanosleep(&ts, NULL);
+	}
+	_capture_drain(c);
+	/* Don't lose the evidence of a loss right before shutting down */
+	if (c->snap_pending)
+		_capture_dump(c);
+	return NULL;
+}
+
+void capture_opts_init(struct capture_opts* opts) {
+	memset(opts, 0, sizeof(*opts));
+	opts->history_bytes = 16 * 1024 * 1024;
+	opts->history_ns = 60 * 1000000000ULL;
+	opts->after_ns = 2 * 1000000000ULL;
+	opts->max_files = 16;
+}
+
+struct capture* capture_open(const char* path) {
+	return capture_open_opts(path, NULL);
+}
+
+struct capture* capture_open_opts(const char* path, const struct capture_opts* opts) {
+	struct capture* c = calloc(1, sizeof(struct capture));
+	if (!c) {
+		printf("Out of memory\n");
+		return NULL;
+	}
+	c->run = 1;
+
+	if (!spsc_ring_init(&c->ring, CAPTURE_RING)) {
+		printf("Out of memory\n");
+		goto error;
+	}
+
+	/* The thread is the only writer, so the file can batch up packets and write them many at a time.
+	 * Timestamps are kept to the nanosecond, in pcapng if the name asks for it */
+	const size_t l = strlen(path);
+	const bool ng = l > 7 && !strcmp(path + l - 7, ".pcapng");
+	pcap_opts_init(&c->popts);
+	c->popts.format = ng ? PCAP_FORMAT_PCAPNG : PCAP_FORMAT_NSEC;
+	c->popts.snaplen = CAPTURE_SNAPLEN;
+	c->comments = ng;
+
+	if (opts) {
+		/* History mode, path is the pattern for the snapshot names */
+		c->opts = *opts;
+		c->opts.max_files = c->opts.max_files > 0 ? c->opts.max_files : 1;
+		const char* dot = strrchr(path, '.');
+		const size_t plen = dot && !strchr(dot, '/') ? (size_t)(dot - path) : l;
+		snprintf(c->prefix, sizeof(c->prefix), "%.*s", (int)plen, path);
+		snprintf(c->ext, sizeof(c->ext), "%s", path + plen);
+		if (!spsc_ring_init(&c->hist, c->opts.history_bytes)) {
+			printf("Out of memory\n");
+			goto error;
+		}
+	}
+	else if (!(c->file = pcap_file_create_opts(path, PCAP_LLT_RAWIP4, &c->popts))) {
+		printf("Unable to create %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+
+	if (pthread_create(&c->thread, NULL, _capture_thread, c) != 0) {
+		printf("Unable to start the capture thread\n");
+		goto error;
+	}
+	return c;
+
+error:
+	if (c->file)
+		pcap_file_close(c->file);
+	spsc_ring_free(&c->ring);
+	spsc_ring_free(&c->hist);
+	free(c);
+	return NULL;
+}
+
+void capture_snapshot(struct capture* c, const char* reason) {
+	if (!c || c->file || __atomic_load_n(&c->snap_pending, __ATOMIC_ACQUIRE))
+		return; /* A snapshot that is still pending covers this too */
+	snprintf(c->snap_reason, sizeof(c->snap_reason), "%s", reason);
+	c->snap_due = time_now_ns() + c->opts.after_ns;
+	__atomic_store_n(&c->snap_pending, 1, __ATOMIC_RELEASE);
+}
+
+void capture_ip(struct capture* c, uint64_t ts_ns, const void* pkt, size_t len) {
+	const size_t caplen = len > CAPTURE_SNAPLEN ? CAPTURE_SNAPLEN : len;
+	struct capture_rec* rec = spsc_ring_reserve(&c->ring, sizeof(*rec) + caplen);
+	if (!rec)
+		return;
+	rec->ts_ns = ts_ns;
+	rec->caplen = caplen;
+	rec->orglen = len;
+	memcpy(rec + 1, pkt, caplen);
+	spsc_ring_commit(&c->ring);
+}
+
+void capture_icmp(struct capture* c, uint64_t ts_ns, in_addr_t src, in_addr_t dst, uint8_t ttl,
+	const void* data, size_t len, const void* data2, size_t len2) {
+	const size_t orglen = sizeof(struct ip) + len + len2;
+	size_t total = orglen > CAPTURE_SNAPLEN ? CAPTURE_SNAPLEN : orglen;
+	struct capture_rec* rec = spsc_ring_reserve(&c->ring, sizeof(*rec) + total);
+	if (!rec)
+		return;
+	rec->ts_ns = ts_ns;
+	rec->caplen = total;
+	rec->orglen = orglen;
+
+	struct ip* ipf = (struct ip*)(rec + 1);
+	memset(ipf, 0, sizeof(*ipf));
+	ipf->ip_v = IPVERSION;
+	ipf->ip_hl = sizeof(*ipf) / 4;
+	ipf->ip_len = htons(orglen);
+	ipf->ip_ttl = ttl;
+	ipf->ip_p = IPPROTO_ICMP;
+	ipf->ip_src.s_addr = src;
+	ipf->ip_dst.s_addr = dst;
+	ipf->ip_sum = ip_cksum(ipf, sizeof(*ipf));
+
+	/* Cut down to the snap length */
+	char* out = (char*)(ipf + 1);
+	total -= sizeof(*ipf);
+	if (len > total)
+		len = total;
+	memcpy(out, data, len);
+	if (data2 && total > len)
+		memcpy(out + len, data2, total - len);
+	spsc_ring_commit(&c->ring);
+}
+
+in_addr_t capture_local_addr(in_addr_t dst) {
+	struct sockaddr_in sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = dst;
+	sa.sin_port = htons(7);
+
+	/* Connecting a UDP socket only does the route lookup, nothing is sent */
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0)
+		return INADDR_ANY;
+	socklen_t sl = sizeof(sa);
+	if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || getsockname(fd, (struct sockaddr*)&sa, &sl) < 0)
+		sa.sin_addr.s_addr = INADDR_ANY;
+	close(fd);
+	return sa.sin_addr.s_addr;
+}
+
+uint64_t capture_dropped(const struct capture* c) {
+	return c->ring.dropped;
+}
+
+void capture_close(struct capture* c) {
+	if (!c)
+		return;
+	__atomic_store_n(&c->run, 0, __ATOMIC_RELEASE);
+	pthread_join(c->thread, NULL);
+	if (c->ring.dropped)
+		printf("Capture writer fell behind, %llu packets dropped\n", (unsigned long long)c->ring.dropped);
+	if (c->file)
+		pcap_file_close(c->file);
+	spsc_ring_free(&c->ring);
+	spsc_ring_free(&c->hist);
+	free(c);
+}
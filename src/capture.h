@@ -0,0 +1,67 @@
+/**
+ * Packet capture for ping/traceroute, written to pcap off the hot path
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Packets are copied into a lock-free ring and written to a PCAP_LLT_RAWIP4 file by a background thread,
+ * so capturing costs the sender a memcpy and never a syscall. If the writer falls behind, packets are dropped
+ * and counted. Packets must only be added from one thread at a time.
+ */
+struct capture;
+
+/* Nanosecond pcap, or pcapng with a comment on each packet if path ends in .pcapng. Returns NULL if the file can't be created */
+struct capture* capture_open(const char* path);
+
+/**
+ * History mode, for captures that run for years: only the most recent traffic is kept, in memory, and
+ * written out when capture_snapshot says something interesting happened. Snapshots rotate through a fixed
+ * number of files, so memory and disk use never grow.
+ */
+struct capture_opts {
+	size_t history_bytes;	/* Memory for the history, the oldest packets are dropped to make room */
+	uint64_t history_ns;	/* Packets older than this are dropped too */
+	uint64_t after_ns;	/* Keep capturing this long after the trigger before writing the snapshot */
+	int max_files;		/* Snapshots go to path-000.pcap ... path-<max_files-1>.pcap, then wrap around */
+};
+
+/* 16 MB or 60 s of history, 2 s after the trigger, 16 files */
+void capture_opts_init(struct capture_opts* opts);
+
+/* path names the snapshots. NULL opts is the same as capture_open */
+struct capture* capture_open_opts(const char* path, const struct capture_opts* opts);
+
+/* Write the history around now to the next snapshot file. No-op if not in history mode or one is already pending */
+void capture_snapshot(struct capture* c, const char* reason);
+
+/* A full IPv4 packet as seen on a raw socket. ts_ns is CLOCK_REALTIME */
+void capture_ip(struct capture* c, uint64_t ts_ns, const void* pkt, size_t len);
+
+/**
+ * An ICMP message without its IP header (sent packets, datagram sockets). A minimal IPv4 header
+ * is made up from src, dst and ttl so the capture still opens in Wireshark.
+ * The message may be split in two parts (header and payload), data2 can be NULL
+ */
+void capture_icmp(struct capture* c, uint64_t ts_ns, in_addr_t src, in_addr_t dst, uint8_t ttl,
+	const void* data, size_t len, const void* data2, size_t len2);
+
+/* Local address the kernel would send from to reach dst, INADDR_ANY if there is no route */
+in_addr_t capture_local_addr(in_addr_t dst);
+
+uint64_t capture_dropped(const struct capture* c);
+
+/* Writes out everything still queued, stops the thread and closes the file */
+void capture_close(struct capture* c);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,84 @@
+/**
+ * histogram.c -- Log-linear latency histogram
+ */
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+
+void lat_hist_init(struct lat_hist* h) {
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void lat_hist_merge(struct lat_hist* dst, const struct lat_hist* src) {
+	if (!src->count)
+		return;
+	if (dst->count + src->count)
+		dst->jitter = (dst->jitter * dst->count + src->jitter * src->count) / (dst->count + src->count);
+	dst->min = src->min < dst->min ? src->min : dst->min;
+	dst->max = src->max > dst->max ? src->max : dst->max;
+	dst->sum += src->sum;
+	dst->sumsq += src->sumsq;
+	dst->count += src->count;
+	dst->last = src->last;
+	for (int i = 0; i < LAT_HIST_BUCKETS; ++i)
+		dst->buckets[i] += src->buckets[i];
+}
+
+/* Lowest value that maps to bucket i, and the bucket's width */
+static uint64_t _bucket_low(uint32_t i, uint64_t* width) {
+	if (i < 2 * LAT_HIST_SUB_COUNT) {
+		*width = 1;
+		return i;
+	}
+	const int shift = i / LAT_HIST_SUB_COUNT - 1;
+	*width = 1ULL << shift;
+	return (uint64_t)(i % LAT_HIST_SUB_COUNT + LAT_HIST_SUB_COUNT) << shift;
+}
+
+uint64_t lat_hist_percentile(const struct lat_hist* h, double pct) {
+	if (!h->count)
+		return 0;
+	if (pct <= 0)
+		return h->min;
+	if (pct >= 100)
+		return h->max;
+
+	/* Rank of the sample we're after, 1-based */
+	uint64_t rank = (uint64_t)ceil(pct / 100. * h->count);
+	rank = rank ? rank : 1;
+
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < LAT_HIST_BUCKETS; ++i) {
+		seen += h->buckets[i];
+		if (seen < rank)
+			continue;
+
+		/* Middle of the bucket, but never outside what was actually recorded */
+		uint64_t width;
+		uint64_t v = _bucket_low(i, &width) + width / 2;
+		v = v < h->min ? h->min : v;
+		return v > h->max ? h->max : v;
+	}
+	return h->max;
+}
+
+double lat_hist_mean(const struct lat_hist* h) {
+	return h->count ? h->sum / h->count : 0;
+}
+
+double lat_hist_stddev(const struct lat_hist* h) {
+	if (h->count < 2)
+		return 0;
+	const double mean = h->sum / h->count;
+	const double var = h->sumsq / h->count - mean * mean;
+	return var > 0 ? sqrt(var) : 0;
+}
+
+void lat_hist_print(const struct lat_hist* h, const char* prefix) {
+	printf("%sp50=%.3f ms, p90=%.3f ms, p99=%.3f ms, p99.9=%.3f ms, stddev=%.3f ms, jitter=%.3f ms\n", prefix,
+		lat_hist_percentile(h, 50) / 1e6, lat_hist_percentile(h, 90) / 1e6, lat_hist_percentile(h, 99) / 1e6,
+		lat_hist_percentile(h, 99.9) / 1e6, lat_hist_stddev(h) / 1e6, h->jitter / 1e6);
+}
@@ -0,0 +1,74 @@
+/**
+ * Fixed size log-linear latency histogram (HDR style)
+ */
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Values are nanoseconds. Each power of two is split into LAT_HIST_SUB_COUNT linear buckets, so a bucket is never
+ * wider than ~3% of the values in it. Values past 2^LAT_HIST_MAX_BITS ns (~68 s) land in the last bucket.
+ */
+#define LAT_HIST_SUB_BITS 5
+#define LAT_HIST_SUB_COUNT (1 << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAX_BITS 36
+#define LAT_HIST_BUCKETS ((LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB_COUNT)
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	double sum;
+	double sumsq;	/* For the standard deviation */
+	double jitter;	/* RFC 3550 interarrival jitter of consecutive samples */
+	uint64_t last;	/* Previous sample, for jitter */
+	uint32_t buckets[LAT_HIST_BUCKETS];
+};
+
+void lat_hist_init(struct lat_hist* h);
+
+static inline uint32_t lat_hist_index(uint64_t v) {
+	if (v < LAT_HIST_SUB_COUNT)
+		return v;
+	const int msb = 63 - __builtin_clzll(v);
+	if (msb >= LAT_HIST_MAX_BITS)
+		return LAT_HIST_BUCKETS - 1;
+	const int shift = msb - LAT_HIST_SUB_BITS;
+	return (shift + 1) * LAT_HIST_SUB_COUNT + (uint32_t)(v >> shift) - LAT_HIST_SUB_COUNT;
+}
+
+/* Add a sample, in ns */
+static inline void lat_hist_record(struct lat_hist* h, uint64_t v) {
+	if (h->count) {
+		const double d = v > h->last ? (double)(v - h->last) : (double)(h->last - v);
+		h->jitter += (d - h->jitter) / 16;
+	}
+	h->last = v;
+	h->min = v < h->min ? v : h->min;
+	h->max = v > h->max ? v : h->max;
+	h->sum += v;
+	h->sumsq += (double)v * v;
+	++h->count;
+	++h->buckets[lat_hist_index(v)];
+}
+
+/* Fold src into dst. Jitter is combined as a sample weighted average */
+void lat_hist_merge(struct lat_hist* dst, const struct lat_hist* src);
+
+/* Value at the given percentile (0-100), in ns. 0 if the histogram is empty */
+uint64_t lat_hist_percentile(const struct lat_hist* h, double pct);
+
+double lat_hist_mean(const struct lat_hist* h);
+
+double lat_hist_stddev(const struct lat_hist* h);
+
+/* One line summary in ms: percentiles, stddev and jitter */
+void lat_hist_print(const struct lat_hist* h, const char* prefix);
+
+#ifdef __cplusplus
+}
+#endif
@@ -10,6 +10,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <netdb.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+
+#ifdef __linux__
+#	include <linux/filter.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -23,7 +33,10 @@ static inline uint16_t ones_sum(uint16_t lhs, uint16_t rhs) {
     return (a & 0xFFFF) + (a >> 16);
 }
 
-static inline uint16_t ip_cksum(const void* data, size_t len) {
+/**
+ * \brief Reference one's complement sum, one 16-bit word at a time. The fast versions below are tested against this
+ */
+static inline uint16_t ip_cksum_partial_ref(const void* data, size_t len) {
 	size_t rem = len % 2;
 	len /= 2;
 	uint16_t s = 0;
@@ -34,7 +47,162 @@ static inline uint16_t ip_cksum(const void* data, size_t len) {
 		tb.b[0] = *(((const uint8_t*)data) + len*2);
 		s = ones_sum(s, tb.a);
 	}
-	return ~s;
+	return s;
+}
+
+/**
+ * \brief Fold a 64-bit accumulator of 32-bit words down to a 16-bit one's complement sum
+ */
+static inline uint16_t ip_cksum_fold64(uint64_t acc) {
+	acc = (acc >> 32) + (acc & 0xFFFFFFFF);
+	acc = (acc >> 32) + (acc & 0xFFFFFFFF);
+	uint32_t s = (uint32_t)acc;
+	s = (s >> 16) + (s & 0xFFFF);
+	s = (s >> 16) + (s & 0xFFFF);
+	return s;
+}
+
+/**
+ * \brief Sum the last 0-3 bytes of a buffer into acc. An odd byte is the low address half of a zero padded word
+ */
+static inline uint64_t ip_sum64_tail(const uint8_t* p, size_t len, uint64_t acc) {
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w, p, 2);
+		acc += w;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		union { uint16_t a; uint8_t b[2]; } tb = {0};
+		tb.b[0] = *p;
+		acc += tb.a;
+	}
+	return acc;
+}
+
+/**
+ * \brief Portable sum: 32-bit loads into a 64-bit accumulator, folded once at the end.
+ * Byte order and alignment don't matter, the 16-bit halves of each word end up in the same sum either way.
+ */
+static inline uint64_t ip_sum64_generic(const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	uint64_t a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+	for (; len >= 16; len -= 16, p += 16) {
+		uint32_t w[4];
+		memcpy(w, p, 16);
+		a0 += w[0];
+		a1 += w[1];
+		a2 += w[2];
+		a3 += w[3];
+	}
+	for (; len >= 4; len -= 4, p += 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		a0 += w;
+	}
+	return ip_sum64_tail(p, len, a0 + a1 + a2 + a3);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(__rtems__) && !defined(IPUTILS_NO_SIMD)
+#	define IPUTILS_X86_SIMD 1
+#	include <immintrin.h>
+
+/**
+ * \brief SSE2 sum, each 32-bit lane is widened to 64 bits so the accumulators can't overflow
+ */
+__attribute__((target("sse2")))
+static inline uint64_t ip_sum64_sse2(const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+	for (; len >= 32; len -= 32, p += 32) {
+		const __m128i v0 = _mm_loadu_si128((const __m128i*)p);
+		const __m128i v1 = _mm_loadu_si128((const __m128i*)(p + 16));
+		a0 = _mm_add_epi64(a0, _mm_unpacklo_epi32(v0, zero));
+		a1 = _mm_add_epi64(a1, _mm_unpackhi_epi32(v0, zero));
+		a2 = _mm_add_epi64(a2, _mm_unpacklo_epi32(v1, zero));
+		a3 = _mm_add_epi64(a3, _mm_unpackhi_epi32(v1, zero));
+	}
+	a0 = _mm_add_epi64(_mm_add_epi64(a0, a1), _mm_add_epi64(a2, a3));
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i*)lanes, a0);
+	return lanes[0] + lanes[1] + ip_sum64_generic(p, len);
+}
+
+/**
+ * \brief AVX2 version of ip_sum64_sse2, 64 bytes per iteration
+ */
+__attribute__((target("avx2")))
+static inline uint64_t ip_sum64_avx2(const void* data, size_t len) {
+	const uint8_t* p = (const uint8_t*)data;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+	for (; len >= 64; len -= 64, p += 64) {
+		const __m256i v0 = _mm256_loadu_si256((const __m256i*)p);
+		const __m256i v1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+		a0 = _mm256_add_epi64(a0, _mm256_unpacklo_epi32(v0, zero));
+		a1 = _mm256_add_epi64(a1, _mm256_unpackhi_epi32(v0, zero));
+		a2 = _mm256_add_epi64(a2, _mm256_unpacklo_epi32(v1, zero));
+		a3 = _mm256_add_epi64(a3, _mm256_unpackhi_epi32(v1, zero));
+	}
+	a0 = _mm256_add_epi64(_mm256_add_epi64(a0, a1), _mm256_add_epi64(a2, a3));
+
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i*)lanes, a0);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + ip_sum64_sse2(p, len);
+}
+#endif
+
+typedef uint64_t (*ip_sum64_fn)(const void* data, size_t len);
+
+/**
+ * \brief Fastest sum kernel this CPU supports, picked on first use
+ */
+static inline ip_sum64_fn ip_sum64_select() {
+	static ip_sum64_fn fn = NULL;
+	if (fn)
+		return fn;
+#ifdef IPUTILS_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = ip_sum64_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		fn = ip_sum64_sse2;
+	else
+#endif
+		fn = ip_sum64_generic;
+	return fn;
+}
+
+/**
+ * \brief One's complement sum of data, not inverted. Sums of even length blocks can be combined with ones_sum
+ */
+static inline uint16_t ip_cksum_partial(const void* data, size_t len) {
+	/* Headers are too short for the vector kernels to pay off */
+	if (len < 128)
+		return ip_cksum_fold64(ip_sum64_generic(data, len));
+	return ip_cksum_fold64(ip_sum64_select()(data, len));
+}
+
+static inline uint16_t ip_cksum(const void* data, size_t len) {
+	return ~ip_cksum_partial(data, len);
+}
+
+/**
+ * \brief Update a checksum after a 16-bit word changed from `from` to `to`, without touching the rest of the data (RFC 1624 eqn. 3)
+ */
+static inline uint16_t ip_cksum_adjust16(uint16_t cksum, uint16_t from, uint16_t to) {
+	return ~ones_sum(ones_sum(~cksum, ~from), to);
+}
+
+/**
+ * \brief Same as ip_cksum_adjust16, for a 32-bit field. Works in either byte order, the sum doesn't care which half is which
+ */
+static inline uint16_t ip_cksum_adjust32(uint16_t cksum, uint32_t from, uint32_t to) {
+	cksum = ip_cksum_adjust16(cksum, from & 0xFFFF, to & 0xFFFF);
+	return ip_cksum_adjust16(cksum, from >> 16, to >> 16);
 }
 
 static inline struct timespec time_now() {
@@ -43,6 +211,23 @@ static inline struct timespec time_now() {
     return tp;
 }
 
+static inline uint64_t timespec_to_ns(const struct timespec* tp) {
+    return (uint64_t)tp->tv_sec * 1000000000ULL + tp->tv_nsec;
+}
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t time_now_ns() {
+    struct timespec tp = time_now();
+    return timespec_to_ns(&tp);
+}
+
+/* Wall clock time in nanoseconds, the clock kernel timestamps and pcap files use */
+static inline uint64_t time_realtime_ns() {
+    struct timespec tp;
+    clock_gettime(CLOCK_REALTIME, &tp);
+    return timespec_to_ns(&tp);
+}
+
 static inline double time_diff(struct timespec* a, struct timespec* b) {
     double af = a->tv_sec + a->tv_nsec / 1e9;
     double bf = b->tv_sec + b->tv_nsec / 1e9;
@@ -57,6 +242,48 @@ static inline char* time_now_str(char* buf, size_t l) {
 	return buf;
 }
 
+/**
+ * \brief Attach a classic BPF filter to a raw ICMP socket. Only echo replies carrying ident, and ICMP errors quoting one of
+ * our echo requests, wake up the reader. Returns false where socket filters aren't available (or the kernel refused),
+ * the caller must check everything it receives either way.
+ */
+static inline bool icmp_attach_filter(int fd, uint16_t ident) {
+#ifdef SO_ATTACH_FILTER
+	/* The ident goes out in host order, BPF loads are big endian */
+	const uint32_t id = ntohs(ident);
+	struct sock_filter code[] = {
+		/* 0 */ BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),		/* X = IP header length */
+		/* 1 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),		/* ICMP type */
+		/* 2 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 2),
+		/* 3 */ BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4),		/* Echo ident */
+		/* 4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 14, 15),
+		/* 5 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_UNREACH, 2, 0),
+		/* 6 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIMXCEED, 1, 0),
+		/* 7 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_PARAMPROB, 0, 12),
+		/* Errors quote the offending IP header and at least 8 bytes past it */
+		/* 8 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8 + 9),	/* Quoted protocol */
+		/* 9 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_ICMP, 0, 10),
+		/* 10 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),		/* X += quoted IP header length */
+		/* 11 */ BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xF),
+		/* 12 */ BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+		/* 13 */ BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+		/* 14 */ BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		/* 15 */ BPF_STMT(BPF_LD | BPF_B | BPF_IND, 8),		/* Quoted ICMP type */
+		/* 16 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 0, 3),
+		/* 17 */ BPF_STMT(BPF_LD | BPF_H | BPF_IND, 8 + 4),	/* Quoted ident */
+		/* 18 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+		/* 19 */ BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+		/* 20 */ BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == 0;
+#else
+	(void)fd;
+	(void)ident;
+	return false;
+#endif
+}
+
 #define CLAMP(_val, _min, _max) ((_val) < (_min) ? (_min) : ((_val) > (_max) ? (_max) : (_val)))
 
 #ifdef __cplusplus
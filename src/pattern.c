@@ -0,0 +1,93 @@
+/**
+ * pattern.c -- Payload pattern generators
+ */
+#include <string.h>
+#include <strings.h>
+
+#include "pattern.h"
+
+static const char* const s_names[PATTERN_NUM] = {"fill", "incr", "prbs7", "prbs15", "prbs31", "random"};
+
+/**
+ * PRBS with polynomial x^n + x^m + 1, bits MSB first. Every bit is b[t] = b[t-n] ^ b[t-m], so the next m bits
+ * only depend on bits we already have and come out of one shift and xor of the register.
+ */
+static void _prbs_fill(int n, int m, uint8_t seed, uint8_t* p, size_t len) {
+	const uint64_t nmask = (1ULL << n) - 1;
+	const uint64_t kmask = (1ULL << m) - 1;
+	uint64_t r = (seed | ((uint64_t)seed << 8) | 1) & nmask; /* Never all zeros, the sequence would be stuck there */
+	uint64_t acc = 0;
+	int bits = 0;
+
+	for (size_t i = 0; i < len;) {
+		const uint64_t next = ((r >> (n - m)) ^ r) & kmask;
+		r = ((r << m) | next) & nmask;
+		acc = (acc << m) | next;
+		bits += m;
+		for (; bits >= 8 && i < len; bits -= 8)
+			p[i++] = (uint8_t)(acc >> (bits - 8));
+	}
+}
+
+static uint64_t _splitmix64(uint64_t* x) {
+	uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/* 8 bytes per step, regenerating a 16 KB payload to verify it costs about as much as comparing it */
+static void _random_fill(uint8_t seed, uint16_t seq, uint8_t* p, size_t len) {
+	uint64_t x = ((uint64_t)seed << 16) | seq;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		const uint64_t v = _splitmix64(&x);
+		memcpy(p + i, &v, 8);
+	}
+	if (i < len) {
+		const uint64_t v = _splitmix64(&x);
+		memcpy(p + i, &v, len - i);
+	}
+}
+
+void pattern_fill(int mode, uint8_t seed, uint16_t seq, void* buf, size_t len) {
+	uint8_t* p = (uint8_t*)buf;
+	switch (mode) {
+	case PATTERN_INCR:
+		for (size_t i = 0; i < len; ++i)
+			p[i] = (uint8_t)(seed + i);
+		break;
+	case PATTERN_PRBS7:
+		_prbs_fill(7, 6, seed, p, len);
+		break;
+	case PATTERN_PRBS15:
+		_prbs_fill(15, 14, seed, p, len);
+		break;
+	case PATTERN_PRBS31:
+		_prbs_fill(31, 28, seed, p, len);
+		break;
+	case PATTERN_RANDOM:
+		_random_fill(seed, seq, p, len);
+		break;
+	case PATTERN_FILL:
+	default:
+		memset(p, seed, len);
+		break;
+	}
+}
+
+bool pattern_per_packet(int mode) {
+	return mode == PATTERN_RANDOM;
+}
+
+const char* pattern_name(int mode) {
+	return mode >= 0 && mode < PATTERN_NUM ? s_names[mode] : "unknown";
+}
+
+int pattern_parse(const char* name) {
+	for (int i = 0; i < PATTERN_NUM; ++i) {
+		if (!strcasecmp(name, s_names[i]))
+			return i;
+	}
+	return -1;
+}
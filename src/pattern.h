@@ -0,0 +1,40 @@
+/**
+ * Payload patterns for ping, cheap to generate and to verify
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum pattern_mode {
+	PATTERN_FILL = 0,	/* Every byte is the seed */
+	PATTERN_INCR,		/* seed, seed + 1, ... wrapping at 0xFF */
+	PATTERN_PRBS7,		/* ITU-T O.150 pseudo random bit sequences, x^7 + x^6 + 1 */
+	PATTERN_PRBS15,		/* x^15 + x^14 + 1 */
+	PATTERN_PRBS31,		/* x^31 + x^28 + 1 */
+	PATTERN_RANDOM,		/* Pseudo random bytes keyed by seed and seq, different in every packet */
+	PATTERN_NUM
+};
+
+/**
+ * Fill len bytes of buf with the pattern. seed is the fill byte, start value or generator seed.
+ * seq only matters for modes where pattern_per_packet() is true.
+ */
+void pattern_fill(int mode, uint8_t seed, uint16_t seq, void* buf, size_t len);
+
+/* True if the payload changes with seq, so it can't be generated once per run */
+bool pattern_per_packet(int mode);
+
+const char* pattern_name(int mode);
+
+/* Mode for a name as printed by pattern_name, -1 if there's none */
+int pattern_parse(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
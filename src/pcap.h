@@ -1,4 +1,3 @@
-
 #ifndef _PCAP_H_
 #define _PCAP_H_
 
@@ -6,12 +5,15 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #pragma pack(1)
 
 #define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_MAGIC_NSEC 0xA1B23C4D  /* Same layout, tsu holds nanoseconds */
 #define PCAP_VERSION_MAJOR 2
 #define PCAP_VERSION_MINOR 4
 
@@ -39,9 +41,93 @@ typedef struct pcap_packet_header {
     uint32_t orglen;    /* Original length */
 } pcap_packet_header_t;
 
+/* pcapng blocks, only what a streaming writer needs. Every block ends with its length again */
+#define PCAPNG_BLOCK_SHB 0x0A0D0D0AU
+#define PCAPNG_BLOCK_IDB 0x00000001U
+#define PCAPNG_BLOCK_EPB 0x00000006U
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1A2B3C4DU
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_COMMENT 1
+#define PCAPNG_OPT_SHB_USERAPPL 4
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+
+typedef struct pcapng_shb {
+    uint32_t type;
+    uint32_t len;
+    uint32_t byte_order;
+    uint16_t ver_major;
+    uint16_t ver_minor;
+    int64_t section_len;    /* -1, we never seek back to fill it in */
+} pcapng_shb_t;
+
+typedef struct pcapng_idb {
+    uint32_t type;
+    uint32_t len;
+    uint16_t llt;
+    uint16_t reserved;
+    uint32_t snl;
+} pcapng_idb_t;
+
+typedef struct pcapng_epb {
+    uint32_t type;
+    uint32_t len;
+    uint32_t ifid;
+    uint32_t ts_high;       /* Timestamp in if_tsresol units (ns here), split in two */
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t orglen;
+} pcapng_epb_t;
+
+typedef struct pcapng_option {
+    uint16_t code;
+    uint16_t len;           /* Value length, without the padding to 4 bytes */
+} pcapng_option_t;
+
+#pragma pack(0)
+
+enum pcap_format {
+    PCAP_FORMAT_USEC = 0,   /* Classic pcap, microsecond timestamps */
+    PCAP_FORMAT_NSEC,       /* Classic pcap, nanosecond timestamps */
+    PCAP_FORMAT_PCAPNG,     /* pcapng, nanosecond timestamps and per-packet comments */
+};
+
+/* How packets get from pcap_add_packet to the file */
+enum pcap_write_mode {
+    PCAP_WRITE_STDIO = 0,   /* fwrite per packet, stdio does the buffering */
+    PCAP_WRITE_BUFFERED,    /* Packed into a large aligned buffer, written out many packets per syscall */
+    PCAP_WRITE_MMAP,        /* Copied straight into a mapped window of the file, no syscalls per packet at all */
+};
+
+typedef struct pcap_opts {
+    int mode;               /* enum pcap_write_mode */
+    int format;             /* enum pcap_format */
+    size_t buffer_size;     /* Buffer size for PCAP_WRITE_BUFFERED, mapping window for PCAP_WRITE_MMAP */
+    uint64_t flush_ns;      /* Also flush once a packet's timestamp is this far past the last flush, 0 = only when full */
+    uint32_t snaplen;       /* Longer packets are cut down to this */
+} pcap_opts_t;
+
 typedef struct pcap_file {
     FILE* fp;
     struct pcap_header header;
+
+    int mode;
+    int format;
+    int fd;
+    uint64_t flush_ns;
+    uint64_t last_flush;    /* Packet timestamp of the last time based flush, ns */
+
+    /* PCAP_WRITE_BUFFERED */
+    char* buf;
+    size_t buf_size;
+    size_t buf_used;
+
+    /* PCAP_WRITE_MMAP */
+    char* map;
+    size_t map_size;
+    size_t map_used;
+    uint64_t map_off;       /* File offset of the mapped window */
 } pcap_file_t;
 
 typedef struct pcap_timestamp {
@@ -51,19 +137,99 @@ typedef struct pcap_timestamp {
 
 extern pcap_timestamp_t pcap_timestamp_now();
 
+/* Buffered writes with a 1 MB buffer and a 1 second flush bound */
+extern void pcap_opts_init(pcap_opts_t* opts);
+
+/* Plain stdio writer, same as pcap_file_create_opts with PCAP_WRITE_STDIO */
 extern pcap_file_t* pcap_file_create(const char* path, int link_layer_type);
 
+/* Falls back to PCAP_WRITE_BUFFERED if the file can't be mapped */
+extern pcap_file_t* pcap_file_create_opts(const char* path, int link_layer_type, const pcap_opts_t* opts);
+
 extern void pcap_file_close(pcap_file_t* file);
 
+/* Hand everything buffered so far to the kernel */
 extern void pcap_file_flush(pcap_file_t* file);
 
+/* datalen is cut down to the snap length. Returns -1 on write errors */
 extern int pcap_add_packet(pcap_file_t* file, pcap_timestamp_t ts, const void* data, int64_t datalen, int64_t orglen);
 
+/* Same, with a comment attached to the packet. Only pcapng keeps it, comment may be NULL */
+extern int pcap_add_packet_comment(pcap_file_t* file, pcap_timestamp_t ts, const void* data, int64_t datalen, int64_t orglen,
+    const char* comment);
+
 inline static int pcap_add_packet_now(pcap_file_t* file, const void* data, int64_t datalen, int64_t orglen) {
     return pcap_add_packet(file, pcap_timestamp_now(), data, datalen, orglen);
 }
 
-#pragma pack(0)
+#define PCAP_READER_MAX_IF 16
+
+/* What a pcapng section header and its interfaces say about the packets after them. Plain pcap has just the one */
+typedef struct pcap_section {
+    bool swap;              /* Written on a machine of the other byte order */
+    uint32_t num_if;
+    uint16_t if_llt[PCAP_READER_MAX_IF];
+    uint8_t if_tsresol[PCAP_READER_MAX_IF];
+} pcap_section_t;
+
+/**
+ * Reads pcap (either byte order, us or ns) and pcapng straight out of a mapping of the file. Packets are
+ * handed out as pointers into the mapping, nothing is copied. A file that ends in the middle of a packet
+ * (capture still running, or cut short) just ends early with `truncated` set.
+ */
+typedef struct pcap_reader {
+    const uint8_t* data;
+    size_t size;
+    bool mapped;            /* data is an mmap of the file, otherwise a malloc'd copy (no mmap) or the caller's */
+    bool owned;
+
+    int format;             /* enum pcap_format */
+    pcap_section_t sec;     /* Section of the record at pos */
+    uint32_t llt;
+    uint32_t snl;
+    size_t first;           /* Offset of the first record */
+    size_t pos;             /* Offset of the next record for pcap_reader_next */
+    bool truncated;         /* Stopped at a partial or garbled record */
+
+    /* Optional, offset of every packet, and the sections they are in */
+    uint64_t* index;
+    size_t count;
+    pcap_section_t* sections;
+    size_t* section_first;  /* Index of each section's first packet */
+    size_t num_sections;
+} pcap_reader_t;
+
+typedef struct pcap_record {
+    uint64_t ts_ns;         /* Realtime ns */
+    uint32_t caplen;
+    uint32_t orglen;
+    uint32_t ifid;          /* pcapng interface, 0 for pcap */
+    uint32_t llt;           /* Link type of that interface */
+    const uint8_t* data;    /* caplen bytes, inside the mapping */
+    size_t offset;          /* Offset of the record in the file */
+} pcap_record_t;
+
+/* Returns NULL if the file can't be opened or isn't a capture */
+extern pcap_reader_t* pcap_reader_open(const char* path);
+
+/* Same on a buffer that stays owned by the caller */
+extern pcap_reader_t* pcap_reader_open_mem(const void* data, size_t size);
+
+extern void pcap_reader_close(pcap_reader_t* r);
+
+/* Next packet in file order, 1 if there is one, 0 at the end of the file */
+extern int pcap_reader_next(pcap_reader_t* r, pcap_record_t* rec);
+
+extern void pcap_reader_rewind(pcap_reader_t* r);
+
+/* Offsets and sections of every packet in one pass, returns the packet count or -1 if out of memory */
+extern int64_t pcap_reader_build_index(pcap_reader_t* r);
+
+/**
+ * Packet i of the index. Only reads the reader, so any number of threads can share one once the index is built.
+ * Returns 1 if found, 0 if out of range
+ */
+extern int pcap_reader_at(const pcap_reader_t* r, size_t i, pcap_record_t* rec);
 
 #ifdef __clangd__
 #define PCAP_IMPL
@@ -71,10 +237,24 @@ inline static int pcap_add_packet_now(pcap_file_t* file, const void* data, int64
 
 #ifdef PCAP_IMPL
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+
+#ifndef __rtems__
+#include <sys/mman.h>
+#define PCAP_HAVE_MMAP 1
+#endif
+
+#define PCAP_BUFFER_ALIGN 4096
+#define PCAP_MAX_IOV 8
 
 pcap_timestamp_t pcap_timestamp_now() {
     struct timeval tv;
@@ -83,14 +263,233 @@ pcap_timestamp_t pcap_timestamp_now() {
     return t;
 }
 
+void pcap_opts_init(pcap_opts_t* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->mode = PCAP_WRITE_BUFFERED;
+    opts->buffer_size = 1024 * 1024;
+    opts->flush_ns = 1000000000ULL;
+    opts->snaplen = 65535;
+}
+
+/* write() that doesn't give up on short writes */
+static int _pcap_write_all(int fd, const char* data, size_t len) {
+    while (len) {
+        ssize_t r = write(fd, data, len);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += r;
+        len -= r;
+    }
+    return 0;
+}
+
+/* Same for writev, iov is consumed */
+static int _pcap_writev_all(int fd, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t r = writev(fd, iov, n);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+static int _pcap_flush_buffer(pcap_file_t* f) {
+    const size_t used = f->buf_used;
+    f->buf_used = 0;
+    return _pcap_write_all(f->fd, f->buf, used);
+}
+
+#ifdef PCAP_HAVE_MMAP
+/* Slide the window to the next map_size bytes of the file, growing it to fit */
+static int _pcap_map_next(pcap_file_t* f) {
+    if (f->map) {
+        munmap(f->map, f->map_size);
+        f->map = NULL;
+        f->map_off += f->map_size;
+    }
+    f->map_used = 0;
+    if (ftruncate(f->fd, f->map_off + f->map_size) < 0)
+        return -1;
+    void* p = mmap(NULL, f->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, f->map_off);
+    if (p == MAP_FAILED)
+        return -1;
+    f->map = (char*)p;
+    return 0;
+}
+
+static int _pcap_map_copy(pcap_file_t* f, const char* data, size_t len) {
+    while (len) {
+        if (f->map_used == f->map_size && _pcap_map_next(f) < 0)
+            return -1;
+        size_t n = f->map_size - f->map_used;
+        n = n < len ? n : len;
+        memcpy(f->map + f->map_used, data, n);
+        f->map_used += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+#endif
+
+/* Everything that goes into the file passes through here, one record in up to PCAP_MAX_IOV pieces */
+static int _pcap_emit(pcap_file_t* f, const struct iovec* iov, int n) {
+    size_t total = 0;
+    for (int i = 0; i < n; ++i)
+        total += iov[i].iov_len;
+
+    switch (f->mode) {
+    case PCAP_WRITE_BUFFERED:
+        if (f->buf_used + total <= f->buf_size) {
+            for (int i = 0; i < n; ++i) {
+                memcpy(f->buf + f->buf_used, iov[i].iov_base, iov[i].iov_len);
+                f->buf_used += iov[i].iov_len;
+            }
+            return 0;
+        }
+        else {
+            /* Doesn't fit, send the buffer and this record out in a single writev */
+            struct iovec v[PCAP_MAX_IOV + 1];
+            v[0].iov_base = f->buf;
+            v[0].iov_len = f->buf_used;
+            memcpy(v + 1, iov, n * sizeof(*iov));
+            f->buf_used = 0;
+            return _pcap_writev_all(f->fd, v, n + 1);
+        }
+#ifdef PCAP_HAVE_MMAP
+    case PCAP_WRITE_MMAP:
+        for (int i = 0; i < n; ++i) {
+            if (_pcap_map_copy(f, (const char*)iov[i].iov_base, iov[i].iov_len) < 0)
+                return -1;
+        }
+        return 0;
+#endif
+    default:
+        for (int i = 0; i < n; ++i) {
+            if (iov[i].iov_len && fwrite(iov[i].iov_base, iov[i].iov_len, 1, f->fp) != 1)
+                return -1;
+        }
+        return 0;
+    }
+}
+
+static const char s_pcap_zero[4] = {0};
+
+#define PCAPNG_PAD(x) (((x) + 3) & ~3U)
+
+/* Appends an option with its padding, returns the new end */
+static char* _pcapng_put_option(char* p, uint16_t code, const void* data, uint16_t len) {
+    pcapng_option_t opt = {code, len};
+    memcpy(p, &opt, sizeof(opt));
+    if (len)
+        memcpy(p + sizeof(opt), data, len);
+    memset(p + sizeof(opt) + len, 0, PCAPNG_PAD(len) - len);
+    return p + sizeof(opt) + PCAPNG_PAD(len);
+}
+
+/* Closes a block started at blk: end of options and the trailing length. Returns the block length */
+static uint32_t _pcapng_end_block(char* blk, char* p) {
+    p = _pcapng_put_option(p, PCAPNG_OPT_END, NULL, 0);
+    const uint32_t len = p - blk + sizeof(uint32_t);
+    memcpy(p, &len, sizeof(len));
+    memcpy(blk + sizeof(uint32_t), &len, sizeof(len));
+    return len;
+}
+
+/* Section header and the one interface every packet is on, nanosecond timestamps */
+static int _pcapng_write_header(pcap_file_t* f) {
+    static const char app[] = "netUtils";
+    const uint8_t tsresol = 9;
+    char blk[128];
+
+    pcapng_shb_t shb = {PCAPNG_BLOCK_SHB, 0, PCAPNG_BYTE_ORDER_MAGIC, 1, 0, -1};
+    memcpy(blk, &shb, sizeof(shb));
+    char* p = _pcapng_put_option(blk + sizeof(shb), PCAPNG_OPT_SHB_USERAPPL, app, sizeof(app) - 1);
+    struct iovec v = {blk, _pcapng_end_block(blk, p)};
+    if (_pcap_emit(f, &v, 1) < 0)
+        return -1;
+
+    pcapng_idb_t idb = {PCAPNG_BLOCK_IDB, 0, (uint16_t)f->header.llt, 0, f->header.snl};
+    memcpy(blk, &idb, sizeof(idb));
+    p = _pcapng_put_option(blk + sizeof(idb), PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+    v.iov_len = _pcapng_end_block(blk, p);
+    return _pcap_emit(f, &v, 1);
+}
+
+/* Enhanced packet block, header + data + padding [+ comment + padding + end of options] + length */
+static int _pcapng_add_packet(pcap_file_t* f, pcap_timestamp_t ts, const void* data, uint32_t caplen, uint32_t orglen,
+    const char* comment) {
+    const uint64_t t = (uint64_t)ts.sec * 1000000000ULL + ts.nsec;
+    const size_t clen = comment ? strlen(comment) : 0;
+    const uint16_t optlen = clen > 0xFFFC ? 0xFFFC : clen;
+    const uint32_t trailer_len = sizeof(uint32_t) + (optlen ? 2 * sizeof(pcapng_option_t) : 0);
+
+    pcapng_epb_t epb = {PCAPNG_BLOCK_EPB, 0, 0, (uint32_t)(t >> 32), (uint32_t)t, caplen, orglen};
+    epb.len = sizeof(epb) + PCAPNG_PAD(caplen) + (optlen ? PCAPNG_PAD(optlen) : 0) + trailer_len;
+
+    pcapng_option_t opt = {PCAPNG_OPT_COMMENT, optlen};
+    char trailer[sizeof(pcapng_option_t) + sizeof(uint32_t)] = {0};
+    memcpy(trailer + (optlen ? sizeof(pcapng_option_t) : 0), &epb.len, sizeof(epb.len));
+
+    struct iovec v[7];
+    int n = 0;
+    v[n].iov_base = &epb;
+    v[n++].iov_len = sizeof(epb);
+    v[n].iov_base = (void*)data;
+    v[n++].iov_len = caplen;
+    v[n].iov_base = (void*)s_pcap_zero;
+    v[n++].iov_len = PCAPNG_PAD(caplen) - caplen;
+    if (optlen) {
+        v[n].iov_base = &opt;
+        v[n++].iov_len = sizeof(opt);
+        v[n].iov_base = (void*)comment;
+        v[n++].iov_len = optlen;
+        v[n].iov_base = (void*)s_pcap_zero;
+        v[n++].iov_len = PCAPNG_PAD(optlen) - optlen;
+    }
+    v[n].iov_base = trailer;
+    v[n++].iov_len = optlen ? sizeof(trailer) : sizeof(uint32_t);
+    return _pcap_emit(f, v, n);
+}
+
 pcap_file_t* pcap_file_create(const char* path, int link_layer_type) {
+    pcap_opts_t opts;
+    pcap_opts_init(&opts);
+    opts.mode = PCAP_WRITE_STDIO;
+    return pcap_file_create_opts(path, link_layer_type, &opts);
+}
+
+pcap_file_t* pcap_file_create_opts(const char* path, int link_layer_type, const pcap_opts_t* opts) {
     pcap_file_t* f = calloc(1, sizeof(pcap_file_t));
+    if (!f)
+        return NULL;
     f->header.ver_major = PCAP_VERSION_MAJOR;
     f->header.ver_minor = PCAP_VERSION_MINOR;
-    f->header.magic = PCAP_MAGIC;
+    f->header.magic = opts->format == PCAP_FORMAT_NSEC ? PCAP_MAGIC_NSEC : PCAP_MAGIC;
     f->header.tsa = 0; /* All tools set this to 0, apparently */
     f->header.llt = link_layer_type;
-    f->header.snl = 65535;
+    f->header.snl = opts->snaplen ? opts->snaplen : 65535;
+    f->mode = opts->mode;
+    f->format = opts->format;
+    f->fd = -1;
+    f->flush_ns = opts->flush_ns;
+    const pcap_timestamp_t now = pcap_timestamp_now();
+    f->last_flush = (uint64_t)now.sec * 1000000000ULL + now.nsec;
 
     time_t t = time(0);
     struct tm tp = {0};
@@ -98,44 +497,460 @@ pcap_file_t* pcap_file_create(const char* path, int link_layer_type) {
 
     f->header.tz = tp.tm_gmtoff;
 
-    f->fp = fopen(path, "wb");
-    if (!f->fp) {
-        free(f);
-        return NULL;
+    if (f->mode == PCAP_WRITE_STDIO) {
+        f->fp = fopen(path, "wb");
+        if (!f->fp) {
+            free(f);
+            return NULL;
+        }
+    }
+    else {
+        f->fd = open(path, (f->mode == PCAP_WRITE_MMAP ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+        if (f->fd < 0) {
+            free(f);
+            return NULL;
+        }
+    }
+
+#ifdef PCAP_HAVE_MMAP
+    if (f->mode == PCAP_WRITE_MMAP) {
+        /* Windows have to start on page boundaries */
+        const size_t page = sysconf(_SC_PAGESIZE);
+        f->map_size = (opts->buffer_size + page - 1) / page * page;
+        if (!f->map_size || _pcap_map_next(f) < 0) {
+            ftruncate(f->fd, 0);
+            f->map_off = 0;
+            f->mode = PCAP_WRITE_BUFFERED;
+        }
+    }
+#else
+    if (f->mode == PCAP_WRITE_MMAP)
+        f->mode = PCAP_WRITE_BUFFERED;
+#endif
+
+    if (f->mode == PCAP_WRITE_BUFFERED) {
+        f->buf_size = opts->buffer_size ? opts->buffer_size : 1024 * 1024;
+        if (posix_memalign((void**)&f->buf, PCAP_BUFFER_ALIGN, f->buf_size) != 0) {
+            close(f->fd);
+            free(f);
+            return NULL;
+        }
     }
 
-    fwrite(&f->header, sizeof(f->header), 1, f->fp);
+    struct iovec v = {&f->header, sizeof(f->header)};
+    if ((f->format == PCAP_FORMAT_PCAPNG ? _pcapng_write_header(f) : _pcap_emit(f, &v, 1)) < 0) {
+        pcap_file_close(f);
+        return NULL;
+    }
     return f;
 }
 
 void pcap_file_close(pcap_file_t* file) {
     if (file->fp)
         fclose(file->fp);
+    if (file->buf)
+        _pcap_flush_buffer(file);
+#ifdef PCAP_HAVE_MMAP
+    /* The last window is only partly used, cut the file back to what was written */
+    if (file->map) {
+        munmap(file->map, file->map_size);
+        ftruncate(file->fd, file->map_off + file->map_used);
+    }
+#endif
+    if (file->fd >= 0)
+        close(file->fd);
+    free(file->buf);
     free(file);
 }
 
 void pcap_file_flush(pcap_file_t* file) {
     if (file->fp)
         fflush(file->fp);
+    if (file->buf)
+        _pcap_flush_buffer(file);
+#ifdef PCAP_HAVE_MMAP
+    if (file->map)
+        msync(file->map, file->map_used, MS_ASYNC);
+#endif
 }
 
 int pcap_add_packet(pcap_file_t* file, pcap_timestamp_t ts, const void* data, int64_t datalen, int64_t orglen) {
-    pcap_packet_header_t pack;
-    pack.caplen = datalen;
-    pack.orglen = orglen;
-    pack.tss = ts.sec;
-    pack.tsu = ts.nsec / 1e3;
-    if (fwrite(&pack, sizeof(pack), 1, file->fp) != 1)
-        return -1;
-    if (fwrite(data, datalen, 1, file->fp) != 1)
-        return -1;
+    return pcap_add_packet_comment(file, ts, data, datalen, orglen, NULL);
+}
+
+int pcap_add_packet_comment(pcap_file_t* file, pcap_timestamp_t ts, const void* data, int64_t datalen, int64_t orglen,
+    const char* comment) {
+    if (datalen > file->header.snl)
+        datalen = file->header.snl;
+
+    if (file->format == PCAP_FORMAT_PCAPNG) {
+        if (_pcapng_add_packet(file, ts, data, datalen, orglen, comment) < 0)
+            return -1;
+    }
+    else {
+        pcap_packet_header_t pack;
+        pack.caplen = datalen;
+        pack.orglen = orglen;
+        pack.tss = ts.sec;
+        pack.tsu = file->format == PCAP_FORMAT_NSEC ? ts.nsec : ts.nsec / 1000;
+
+        struct iovec v[2] = {{&pack, sizeof(pack)}, {(void*)data, (size_t)datalen}};
+        if (_pcap_emit(file, v, 2) < 0)
+            return -1;
+    }
+
+    /* Time bound, so a slow trickle of packets still reaches the file */
+    if (file->flush_ns && file->mode != PCAP_WRITE_STDIO) {
+        const uint64_t now = (uint64_t)ts.sec * 1000000000ULL + ts.nsec;
+        if (now < file->last_flush)
+            file->last_flush = now; /* Clock stepped back */
+        else if (now - file->last_flush >= file->flush_ns) {
+            file->last_flush = now;
+            pcap_file_flush(file);
+        }
+    }
     return 0;
 }
 
+static inline uint32_t _pcap_rd32(const pcap_section_t* sec, const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return sec->swap ? __builtin_bswap32(v) : v;
+}
+
+static inline uint16_t _pcap_rd16(const pcap_section_t* sec, const uint8_t* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return sec->swap ? __builtin_bswap16(v) : v;
+}
+
+/* pcapng timestamps count 10^-res (or 2^-res with the top bit set) seconds */
+static uint64_t _pcapng_ts_ns(uint64_t ts, uint8_t res) {
+    if (res & 0x80)
+        return (uint64_t)((long double)ts * 1e9L / (long double)(1ULL << (res & 0x3F)));
+    uint64_t ns = ts;
+    for (; res < 9; ++res)
+        ns *= 10;
+    for (; res > 9; --res)
+        ns /= 10;
+    return ns;
+}
+
+/* Section header, sets the byte order for everything after it. Returns false if it isn't one */
+static bool _pcapng_section(pcap_reader_t* r, size_t off) {
+    uint32_t bom;
+    if (off + 28 > r->size)
+        return false;
+    memcpy(&bom, r->data + off + 8, sizeof(bom));
+    if (bom != PCAPNG_BYTE_ORDER_MAGIC && bom != __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+        return false;
+    r->sec.swap = bom != PCAPNG_BYTE_ORDER_MAGIC;
+    r->sec.num_if = 0;
+    return true;
+}
+
+static void _pcapng_interface(pcap_reader_t* r, const uint8_t* blk, uint32_t len) {
+    pcap_section_t* sec = &r->sec;
+    if (sec->num_if >= PCAP_READER_MAX_IF)
+        return;
+    const uint32_t i = sec->num_if++;
+    sec->if_llt[i] = _pcap_rd16(sec, blk + 8);
+    sec->if_tsresol[i] = 6;
+    if (i == 0) {
+        r->llt = sec->if_llt[0];
+        r->snl = _pcap_rd32(sec, blk + 12);
+    }
+
+    /* Only if_tsresol matters to us */
+    for (uint32_t o = 16; o + 4 <= len - 4;) {
+        const uint16_t code = _pcap_rd16(sec, blk + o), olen = _pcap_rd16(sec, blk + o + 2);
+        if (code == PCAPNG_OPT_END || o + 4 + olen > len - 4)
+            break;
+        if (code == PCAPNG_OPT_IF_TSRESOL && olen >= 1)
+            sec->if_tsresol[i] = blk[o + 4];
+        o += 4 + PCAPNG_PAD(olen);
+    }
+}
+
+/**
+ * Parses the packet at off, which is in section sec. Returns the offset of the record after it, 0 if off is
+ * at the end or the record is cut short. *packet is false for pcapng blocks that aren't packets, those are
+ * applied to the reader if r_state is set (and sec should be its sec then)
+ */
+static size_t _pcap_reader_parse(const pcap_reader_t* r, const pcap_section_t* sec, pcap_reader_t* r_state, size_t off,
+    pcap_record_t* rec, bool* packet) {
+    *packet = false;
+    if (r->format != PCAP_FORMAT_PCAPNG) {
+        if (off + sizeof(pcap_packet_header_t) > r->size)
+            return 0;
+        const uint8_t* p = r->data + off;
+        const uint32_t tss = _pcap_rd32(sec, p), tsu = _pcap_rd32(sec, p + 4);
+        rec->caplen = _pcap_rd32(sec, p + 8);
+        rec->orglen = _pcap_rd32(sec, p + 12);
+        if (rec->caplen > r->size - off - sizeof(pcap_packet_header_t))
+            return 0;
+        rec->ts_ns = (uint64_t)tss * 1000000000ULL + (r->format == PCAP_FORMAT_NSEC ? tsu : (uint64_t)tsu * 1000);
+        rec->ifid = 0;
+        rec->llt = r->llt;
+        rec->data = p + sizeof(pcap_packet_header_t);
+        rec->offset = off;
+        *packet = true;
+        return off + sizeof(pcap_packet_header_t) + rec->caplen;
+    }
+
+    if (off + 12 > r->size)
+        return 0;
+    const uint8_t* blk = r->data + off;
+    uint32_t type = _pcap_rd32(sec, blk);
+    if (type == PCAPNG_BLOCK_SHB) {
+        /* A new section may switch byte order, the length has to be read with it */
+        if (!r_state || !_pcapng_section(r_state, off))
+            return 0;
+    }
+    const uint32_t len = _pcap_rd32(sec, blk + 4);
+    if (len < 12 || (len & 3) || len > r->size - off)
+        return 0;
+
+    if (type == PCAPNG_BLOCK_EPB) {
+        if (len < sizeof(pcapng_epb_t) + 4)
+            return 0;
+        const uint32_t ifid = _pcap_rd32(sec, blk + 8);
+        const uint64_t ts = ((uint64_t)_pcap_rd32(sec, blk + 12) << 32) | _pcap_rd32(sec, blk + 16);
+        rec->caplen = _pcap_rd32(sec, blk + 20);
+        rec->orglen = _pcap_rd32(sec, blk + 24);
+        if (rec->caplen > len - sizeof(pcapng_epb_t) - 4)
+            return 0;
+        rec->ts_ns = _pcapng_ts_ns(ts, ifid < sec->num_if ? sec->if_tsresol[ifid] : 6);
+        rec->ifid = ifid;
+        rec->llt = ifid < sec->num_if ? sec->if_llt[ifid] : r->llt;
+        rec->data = blk + sizeof(pcapng_epb_t);
+        rec->offset = off;
+        *packet = true;
+    }
+    else if (type == PCAPNG_BLOCK_IDB && r_state && len >= 20)
+        _pcapng_interface(r_state, blk, len);
+    return off + len;
+}
+
+static pcap_reader_t* _pcap_reader_init(pcap_reader_t* r) {
+    uint32_t magic;
+    if (r->size < sizeof(pcap_header_t))
+        return NULL;
+    memcpy(&magic, r->data, sizeof(magic));
+
+    switch (magic) {
+    case PCAP_MAGIC:
+    case PCAP_MAGIC_NSEC:
+        r->format = magic == PCAP_MAGIC ? PCAP_FORMAT_USEC : PCAP_FORMAT_NSEC;
+        break;
+    case __builtin_bswap32(PCAP_MAGIC):
+    case __builtin_bswap32(PCAP_MAGIC_NSEC):
+        r->format = magic == __builtin_bswap32(PCAP_MAGIC) ? PCAP_FORMAT_USEC : PCAP_FORMAT_NSEC;
+        r->sec.swap = true;
+        break;
+    case PCAPNG_BLOCK_SHB:
+        r->format = PCAP_FORMAT_PCAPNG;
+        if (!_pcapng_section(r, 0))
+            return NULL;
+        break;
+    default:
+        return NULL;
+    }
+
+    if (r->format != PCAP_FORMAT_PCAPNG) {
+        r->snl = _pcap_rd32(&r->sec, r->data + 16);
+        r->llt = _pcap_rd32(&r->sec, r->data + 20);
+        r->first = sizeof(pcap_header_t);
+    }
+    else {
+        /* Link type comes from the interfaces, look ahead to the first packet for them */
+        pcap_record_t rec;
+        bool packet = false;
+        size_t off = 0;
+        do
+            off = _pcap_reader_parse(r, &r->sec, r, off, &rec, &packet);
+        while (off && off < r->size && !packet);
+        _pcapng_section(r, 0);
+    }
+    r->pos = r->first;
+    return r;
+}
+
+pcap_reader_t* pcap_reader_open_mem(const void* data, size_t size) {
+    pcap_reader_t* r = calloc(1, sizeof(pcap_reader_t));
+    if (!r)
+        return NULL;
+    r->data = (const uint8_t*)data;
+    r->size = size;
+    if (!_pcap_reader_init(r)) {
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+pcap_reader_t* pcap_reader_open(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(pcap_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    pcap_reader_t* r = calloc(1, sizeof(pcap_reader_t));
+    if (!r) {
+        close(fd);
+        return NULL;
+    }
+    r->size = st.st_size;
+    r->owned = true;
+
+#ifdef PCAP_HAVE_MMAP
+    void* p = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+        madvise(p, r->size, MADV_SEQUENTIAL);
+        r->data = (const uint8_t*)p;
+        r->mapped = true;
+    }
+#endif
+    /* No mmap, one big read is the next best thing */
+    if (!r->mapped) {
+        uint8_t* buf = malloc(r->size);
+        size_t got = 0;
+        while (buf && got < r->size) {
+            ssize_t n = read(fd, buf + got, r->size - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        r->data = buf;
+        r->size = got;
+    }
+    close(fd);
+
+    if (!r->data || !_pcap_reader_init(r)) {
+        pcap_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void pcap_reader_close(pcap_reader_t* r) {
+    if (!r)
+        return;
+#ifdef PCAP_HAVE_MMAP
+    if (r->mapped)
+        munmap((void*)r->data, r->size);
+#endif
+    if (r->owned && !r->mapped)
+        free((void*)r->data);
+    free(r->index);
+    free(r->sections);
+    free(r->section_first);
+    free(r);
+}
+
+void pcap_reader_rewind(pcap_reader_t* r) {
+    r->pos = r->first;
+    r->truncated = false;
+    if (r->format == PCAP_FORMAT_PCAPNG)
+        _pcapng_section(r, 0);
+}
+
+int pcap_reader_next(pcap_reader_t* r, pcap_record_t* rec) {
+    bool packet = false;
+    while (!packet) {
+        if (r->pos >= r->size)
+            return 0;
+        size_t next = _pcap_reader_parse(r, &r->sec, r, r->pos, rec, &packet);
+        if (!next) {
+            r->truncated = true;
+            return 0;
+        }
+        r->pos = next;
+    }
+    return 1;
+}
+
+/* Starts a new section in the index at packet first, a copy of the one the reader is in now */
+static bool _pcap_index_section(pcap_reader_t* r, size_t first) {
+    pcap_section_t* sections = realloc(r->sections, (r->num_sections + 1) * sizeof(pcap_section_t));
+    if (sections)
+        r->sections = sections;
+    size_t* section_first = realloc(r->section_first, (r->num_sections + 1) * sizeof(size_t));
+    if (section_first)
+        r->section_first = section_first;
+    if (!sections || !section_first)
+        return false;
+    r->sections[r->num_sections] = r->sec;
+    r->section_first[r->num_sections++] = first;
+    return true;
+}
+
+int64_t pcap_reader_build_index(pcap_reader_t* r) {
+    size_t cap = 1024;
+    free(r->index);
+    r->count = 0;
+    r->num_sections = 0;
+    r->index = malloc(cap * sizeof(uint64_t));
+    if (!r->index)
+        return -1;
+
+    /* Only a block that isn't a packet can change the section, the next packet starts a new one after it */
+    pcap_reader_rewind(r);
+    pcap_record_t rec;
+    bool fresh = true;
+    while (r->pos < r->size) {
+        bool packet = false;
+        const size_t next = _pcap_reader_parse(r, &r->sec, r, r->pos, &rec, &packet);
+        if (!next) {
+            r->truncated = true;
+            break;
+        }
+        r->pos = next;
+        if (!packet) {
+            fresh = true;
+            continue;
+        }
+        if (fresh && !_pcap_index_section(r, r->count))
+            return -1;
+        fresh = false;
+        if (r->count == cap) {
+            uint64_t* n = realloc(r->index, cap * 2 * sizeof(uint64_t));
+            if (!n)
+                return -1;
+            r->index = n;
+            cap *= 2;
+        }
+        r->index[r->count++] = rec.offset;
+    }
+    return r->count;
+}
+
+int pcap_reader_at(const pcap_reader_t* r, size_t i, pcap_record_t* rec) {
+    bool packet;
+    if (!r->index || i >= r->count)
+        return 0;
+    /* Last section starting at or before i */
+    size_t lo = 0, hi = r->num_sections;
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (r->section_first[mid] <= i)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return _pcap_reader_parse(r, &r->sections[lo], NULL, r->index[i], rec, &packet) && packet;
+}
+
 #endif
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
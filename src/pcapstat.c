@@ -0,0 +1,504 @@
+/**
+ * pcapstat.c -- Rebuilds ping and traceroute statistics from a capture, on all cores
+ *
+ * The file is mapped and indexed once, then parsed in chunks, one thread each, into compact ICMP events.
+ * Matching replies to requests needs them in order, so the events are then split by target instead of by
+ * file position: every thread walks all chunks in order but only keeps the targets that hash to it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+
+#define PCAP_IMPL
+#include "pcap.h"
+
+#include "histogram.h"
+#include "iputils.h"
+#include "getopt_s.h"
+
+#define PSTAT_MAX_THREADS 256
+#define PSTAT_MAX_TTL 64	/* Requests sent with a lower TTL are taken as traceroute probes */
+#define PSTAT_HOP_ADDRS 4	/* Responders kept per hop, more than one means the path changed or ECMP */
+
+enum pstat_kind {
+	PSTAT_REQUEST,
+	PSTAT_REPLY,
+	PSTAT_ERROR,	/* Time exceeded or unreachable, quoting one of our requests */
+};
+
+/* What the parse pass keeps of each ICMP packet */
+struct pstat_event {
+	uint64_t ts;
+	in_addr_t target;	/* Destination of the request */
+	in_addr_t from;		/* Responder, for errors */
+	uint16_t id;
+	uint16_t seq;
+	uint8_t kind;
+	uint8_t ttl;		/* Requests only */
+	uint8_t type;		/* ICMP type, errors only */
+};
+
+struct pstat_chunk {
+	const pcap_reader_t* reader;
+	size_t first, last;
+	struct pstat_event* events;
+	size_t count, cap;
+	uint64_t skipped;	/* Not IPv4 ICMP, or not something we understand */
+};
+
+struct pstat_hop {
+	uint64_t count;
+	uint64_t rtt_sum;
+	uint64_t rtt_max;
+	in_addr_t addrs[PSTAT_HOP_ADDRS];
+	uint64_t addr_count[PSTAT_HOP_ADDRS];
+};
+
+struct pstat_target {
+	in_addr_t addr;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t errors;	/* Requests answered by an ICMP error instead */
+	uint64_t dups;
+	uint64_t reordered;	/* Replies that arrived after the reply to a later request */
+	uint64_t order;		/* Requests seen so far */
+	uint64_t newest;	/* order + 1 of the newest request answered */
+	struct lat_hist hist;
+	int max_hop;
+	struct pstat_hop hops[PSTAT_MAX_TTL];
+};
+
+/* An outstanding request, keyed by target, id and seq */
+struct pstat_req {
+	in_addr_t target;
+	uint16_t id, seq;
+	uint64_t ts;
+	uint64_t order;
+	struct pstat_target* t;
+	uint8_t ttl;
+	uint8_t used;
+	uint8_t answered;
+};
+
+struct pstat_part {
+	int index, count;
+	const struct pstat_chunk* chunks;
+	int num_chunks;
+	struct pstat_target** targets;
+	size_t num_targets, cap_targets;
+	int* table;		/* Open addressed addr -> index into targets, twice cap_targets */
+	struct pstat_req* reqs;
+	size_t req_mask, req_used;
+	uint64_t unmatched;	/* Replies and errors to requests not in the capture */
+};
+
+/* Full avalanche, addresses of one subnet only differ in a few bits and the tables mask off the low ones */
+static uint32_t _mix32(uint32_t h) {
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static uint32_t _addr_hash(in_addr_t addr) {
+	return _mix32(addr);
+}
+
+/* Which of count threads gets a target. Takes the high bits of the hash, the target tables already use the low ones */
+static uint32_t _addr_part(in_addr_t addr, int count) {
+	return (uint32_t)(((uint64_t)_addr_hash(addr) * (uint32_t)count) >> 32);
+}
+
+static uint32_t _req_hash(in_addr_t target, uint16_t id, uint16_t seq) {
+	return _mix32(target ^ _mix32((uint32_t)id << 16 | seq));
+}
+
+/* IPv4 packet inside the capture's link layer, NULL if there isn't one */
+static const struct ip* _pstat_ip(uint32_t llt, const uint8_t* p, uint32_t* len) {
+	if (llt == PCAP_LLT_ETH8023) {
+		if (*len < 14 || p[12] != 0x08 || p[13] != 0x00)
+			return NULL;
+		p += 14;
+		*len -= 14;
+	}
+	else if (llt != PCAP_LLT_RAWIP && llt != PCAP_LLT_RAWIP4)
+		return NULL;
+	const struct ip* ipf = (const struct ip*)p;
+	if (*len < sizeof(struct ip) || ipf->ip_v != IPVERSION || *len < ipf->ip_hl * 4u + ICMP_MINLEN || ipf->ip_p != IPPROTO_ICMP)
+		return NULL;
+	return ipf;
+}
+
+static bool _pstat_parse(uint32_t llt, const pcap_record_t* rec, struct pstat_event* ev) {
+	uint32_t len = rec->caplen;
+	const struct ip* ipf = _pstat_ip(llt, rec->data, &len);
+	if (!ipf)
+		return false;
+	const struct icmp* icmp = (const struct icmp*)((const uint8_t*)ipf + ipf->ip_hl * 4);
+	const uint8_t type = icmp->icmp_type;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->ts = rec->ts_ns;
+	switch (type) {
+	case ICMP_ECHO:
+		ev->kind = PSTAT_REQUEST;
+		ev->target = ipf->ip_dst.s_addr;
+		ev->ttl = ipf->ip_ttl;
+		break;
+	case ICMP_ECHOREPLY:
+		ev->kind = PSTAT_REPLY;
+		ev->target = ipf->ip_src.s_addr;
+		break;
+	case ICMP_TIMXCEED:
+	case ICMP_UNREACH: {
+		/* The quoted header says which request it was */
+		const uint32_t off = ipf->ip_hl * 4 + ICMP_MINLEN;
+		const struct ip* q = (const struct ip*)((const uint8_t*)ipf + off);
+		if (len < off + sizeof(*q) || len < off + q->ip_hl * 4u + ICMP_MINLEN || q->ip_p != IPPROTO_ICMP)
+			return false;
+		icmp = (const struct icmp*)((const uint8_t*)q + q->ip_hl * 4);
+		if (icmp->icmp_type != ICMP_ECHO)
+			return false;
+		ev->kind = PSTAT_ERROR;
+		ev->type = type;
+		ev->target = q->ip_dst.s_addr;
+		ev->from = ipf->ip_src.s_addr;
+		break;
+	}
+	default:
+		return false;
+	}
+	ev->id = icmp->icmp_id;
+	ev->seq = icmp->icmp_seq;
+	return true;
+}
+
+static void* _pstat_parse_chunk(void* arg) {
+	struct pstat_chunk* c = (struct pstat_chunk*)arg;
+	c->cap = c->last - c->first;
+	c->events = malloc(sizeof(struct pstat_event) * (c->cap ? c->cap : 1));
+	if (!c->events)
+		return NULL;
+
+	pcap_record_t rec;
+	for (size_t i = c->first; i < c->last; ++i) {
+		if (!pcap_reader_at(c->reader, i, &rec) || !_pstat_parse(rec.llt, &rec, &c->events[c->count]))
+			++c->skipped;
+		else
+			++c->count;
+	}
+	return NULL;
+}
+
+static int* _pstat_slot(struct pstat_part* p, in_addr_t addr) {
+	const uint32_t mask = p->cap_targets * 2 - 1;
+	uint32_t h = _addr_hash(addr) & mask;
+	while (p->table[h] >= 0 && p->targets[p->table[h]]->addr != addr)
+		h = (h + 1) & mask;
+	return &p->table[h];
+}
+
+static struct pstat_target* _pstat_target(struct pstat_part* p, in_addr_t addr) {
+	int* slot = p->table ? _pstat_slot(p, addr) : NULL;
+	if (slot && *slot >= 0)
+		return p->targets[*slot];
+
+	if (p->num_targets == p->cap_targets) {
+		const size_t cap = p->cap_targets ? p->cap_targets * 2 : 16;
+		struct pstat_target** n = realloc(p->targets, cap * sizeof(*n));
+		int* table = malloc(cap * 2 * sizeof(int));
+		if (!n || !table) {
+			free(table);
+			return NULL;
+		}
+		p->targets = n;
+		p->cap_targets = cap;
+		free(p->table);
+		p->table = table;
+		memset(p->table, -1, cap * 2 * sizeof(int));
+		for (size_t i = 0; i < p->num_targets; ++i)
+			*_pstat_slot(p, p->targets[i]->addr) = i;
+		slot = _pstat_slot(p, addr);
+	}
+
+	struct pstat_target* t = calloc(1, sizeof(struct pstat_target));
+	if (!t)
+		return NULL;
+	t->addr = addr;
+	lat_hist_init(&t->hist);
+	*slot = p->num_targets;
+	p->targets[p->num_targets++] = t;
+	return t;
+}
+
+/* Slot of the request with this key, or the empty slot it would go in */
+static struct pstat_req* _pstat_req(struct pstat_part* p, in_addr_t target, uint16_t id, uint16_t seq) {
+	uint32_t h = _req_hash(target, id, seq) & p->req_mask;
+	for (;; h = (h + 1) & p->req_mask) {
+		struct pstat_req* r = &p->reqs[h];
+		if (!r->used || (r->target == target && r->id == id && r->seq == seq))
+			return r;
+	}
+}
+
+static bool _pstat_grow(struct pstat_part* p) {
+	struct pstat_req* old = p->reqs;
+	const size_t old_size = p->req_mask + 1;
+	p->req_mask = old ? old_size * 2 - 1 : 4095;
+	p->reqs = calloc(p->req_mask + 1, sizeof(struct pstat_req));
+	if (!p->reqs) {
+		p->reqs = old;
+		p->req_mask = old_size - 1;
+		return false;
+	}
+	for (size_t i = 0; old && i < old_size; ++i) {
+		if (old[i].used)
+			*_pstat_req(p, old[i].target, old[i].id, old[i].seq) = old[i];
+	}
+	free(old);
+	return true;
+}
+
+static void _pstat_hop(struct pstat_target* t, uint8_t ttl, in_addr_t from, uint64_t rtt) {
+	if (ttl == 0 || ttl >= PSTAT_MAX_TTL)
+		return;
+	struct pstat_hop* h = &t->hops[ttl];
+	++h->count;
+	h->rtt_sum += rtt;
+	h->rtt_max = rtt > h->rtt_max ? rtt : h->rtt_max;
+	for (int i = 0; i < PSTAT_HOP_ADDRS; ++i) {
+		if (!h->addr_count[i] || h->addrs[i] == from) {
+			h->addrs[i] = from;
+			++h->addr_count[i];
+			break;
+		}
+	}
+	t->max_hop = ttl > t->max_hop ? ttl : t->max_hop;
+}
+
+static void _pstat_event(struct pstat_part* p, const struct pstat_event* ev) {
+	if (ev->kind == PSTAT_REQUEST) {
+		struct pstat_target* t = _pstat_target(p, ev->target);
+		if (!t)
+			return;
+		if (p->req_used * 2 >= p->req_mask && !_pstat_grow(p))
+			return;
+		struct pstat_req* r = _pstat_req(p, ev->target, ev->id, ev->seq);
+		if (!r->used)
+			++p->req_used;
+		/* Same key again once seq wraps, the old request is done with either way */
+		r->target = ev->target;
+		r->id = ev->id;
+		r->seq = ev->seq;
+		r->ts = ev->ts;
+		r->ttl = ev->ttl;
+		r->t = t;
+		r->order = t->order++;
+		r->used = 1;
+		r->answered = 0;
+		++t->sent;
+		return;
+	}
+
+	struct pstat_req* r = p->reqs ? _pstat_req(p, ev->target, ev->id, ev->seq) : NULL;
+	if (!r || !r->used || ev->ts < r->ts) {
+		++p->unmatched;
+		return;
+	}
+	struct pstat_target* t = r->t;
+	const uint64_t rtt = ev->ts - r->ts;
+
+	if (r->answered) {
+		if (ev->kind == PSTAT_REPLY)
+			++t->dups;
+		return;
+	}
+	r->answered = 1;
+
+	if (ev->kind == PSTAT_ERROR) {
+		++t->errors;
+		_pstat_hop(t, r->ttl, ev->from, rtt);
+		return;
+	}
+
+	++t->received;
+	lat_hist_record(&t->hist, rtt);
+	if (r->order + 1 < t->newest)
+		++t->reordered;
+	t->newest = r->order + 1 > t->newest ? r->order + 1 : t->newest;
+	_pstat_hop(t, r->ttl, ev->target, rtt);
+}
+
+static void* _pstat_match(void* arg) {
+	struct pstat_part* p = (struct pstat_part*)arg;
+	if (!_pstat_grow(p))
+		return NULL;
+	for (int c = 0; c < p->num_chunks; ++c) {
+		const struct pstat_chunk* ch = &p->chunks[c];
+		for (size_t i = 0; i < ch->count; ++i) {
+			const struct pstat_event* ev = &ch->events[i];
+			if (_addr_part(ev->target, p->count) == (uint32_t)p->index)
+				_pstat_event(p, ev);
+		}
+	}
+	return NULL;
+}
+
+static int _pstat_cmp(const void* a, const void* b) {
+	const uint32_t x = ntohl((*(struct pstat_target* const*)a)->addr), y = ntohl((*(struct pstat_target* const*)b)->addr);
+	return x < y ? -1 : x > y;
+}
+
+static void _pstat_print(const struct pstat_target* t) {
+	char name[INET_ADDRSTRLEN];
+	struct in_addr a = {t->addr};
+	inet_ntop(AF_INET, &a, name, sizeof(name));
+	const uint64_t lost = t->sent - t->received - t->errors;
+	printf("%s: %llu sent, %llu received, %llu lost (%.2f%%), %llu dup, %llu reordered, %llu errors\n", name,
+		(unsigned long long)t->sent, (unsigned long long)t->received, (unsigned long long)lost,
+		t->sent ? 100.0 * lost / t->sent : 0.0, (unsigned long long)t->dups, (unsigned long long)t->reordered,
+		(unsigned long long)t->errors);
+	if (t->hist.count) {
+		printf("  min=%.3f ms, max=%.3f ms, avg=%.3f ms\n", t->hist.min / 1e6, t->hist.max / 1e6, lat_hist_mean(&t->hist) / 1e6);
+		lat_hist_print(&t->hist, "  ");
+	}
+
+	if (!t->max_hop)
+		return;
+	printf("  path:\n");
+	for (int i = 1; i <= t->max_hop; ++i) {
+		const struct pstat_hop* h = &t->hops[i];
+		if (!h->count) {
+			printf("  %2d *\n", i);
+			continue;
+		}
+		printf("  %2d", i);
+		for (int j = 0; j < PSTAT_HOP_ADDRS && h->addr_count[j]; ++j) {
+			a.s_addr = h->addrs[j];
+			inet_ntop(AF_INET, &a, name, sizeof(name));
+			printf(" %s (%llu)", name, (unsigned long long)h->addr_count[j]);
+		}
+		printf("  avg=%.3f ms max=%.3f ms\n", h->rtt_sum / 1e6 / h->count, h->rtt_max / 1e6);
+	}
+}
+
+static void pcapstat_help() {
+	printf("Usage: pcapstat [-j threads] file.pcap\n");
+	printf("  Per target RTT, loss, duplicates, reordering and traceroute paths from a capture of ping/traceroute traffic\n");
+}
+
+int main(int argc, char** argv) {
+	getopt_state_t st;
+	getopt_state_init(&st);
+
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt_s(argc, argv, "j:h", &st)) != -1) {
+		switch (opt) {
+		case 'j':
+			nthreads = atoi(st.optarg);
+			break;
+		case 'h':
+		default:
+			pcapstat_help();
+			return 1;
+		}
+	}
+	if (st.optind >= argc) {
+		pcapstat_help();
+		return 1;
+	}
+	nthreads = CLAMP(nthreads, 1, PSTAT_MAX_THREADS);
+
+	const uint64_t start = time_now_ns();
+	pcap_reader_t* r = pcap_reader_open(argv[st.optind]);
+	if (!r) {
+		printf("Unable to read %s\n", argv[st.optind]);
+		return 1;
+	}
+	const int64_t packets = pcap_reader_build_index(r);
+	if (packets < 0) {
+		printf("Out of memory\n");
+		pcap_reader_close(r);
+		return 1;
+	}
+	if (r->truncated)
+		printf("%s ends in the middle of a packet, ignoring the tail\n", argv[st.optind]);
+
+	/* Parse, one chunk of the file per thread */
+	const int nchunks = packets < nthreads ? 1 : nthreads;
+	struct pstat_chunk* chunks = calloc(nchunks, sizeof(struct pstat_chunk));
+	pthread_t threads[PSTAT_MAX_THREADS];
+	for (int i = 0; i < nchunks; ++i) {
+		chunks[i].reader = r;
+		chunks[i].first = packets * i / nchunks;
+		chunks[i].last = packets * (i + 1) / nchunks;
+		pthread_create(&threads[i], NULL, _pstat_parse_chunk, &chunks[i]);
+	}
+	uint64_t skipped = 0;
+	for (int i = 0; i < nchunks; ++i) {
+		pthread_join(threads[i], NULL);
+		skipped += chunks[i].skipped;
+	}
+	const uint64_t parsed = time_now_ns();
+
+	/* Match, one share of the targets per thread */
+	struct pstat_part* parts = calloc(nthreads, sizeof(struct pstat_part));
+	for (int i = 0; i < nthreads; ++i) {
+		parts[i].index = i;
+		parts[i].count = nthreads;
+		parts[i].chunks = chunks;
+		parts[i].num_chunks = nchunks;
+		pthread_create(&threads[i], NULL, _pstat_match, &parts[i]);
+	}
+
+	/* Merge, the targets are disjoint so it's just collecting them */
+	size_t num_targets = 0;
+	uint64_t unmatched = 0;
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+		num_targets += parts[i].num_targets;
+		unmatched += parts[i].unmatched;
+	}
+	struct pstat_target** all = calloc(num_targets ? num_targets : 1, sizeof(*all));
+	for (int i = 0, n = 0; i < nthreads; ++i) {
+		for (size_t j = 0; j < parts[i].num_targets; ++j)
+			all[n++] = parts[i].targets[j];
+	}
+	qsort(all, num_targets, sizeof(*all), _pstat_cmp);
+	const uint64_t matched = time_now_ns();
+
+	for (size_t i = 0; i < num_targets; ++i)
+		_pstat_print(all[i]);
+	printf("%lld packets, %llu not ICMP echo, %llu answers to requests not in the capture\n", (long long)packets,
+		(unsigned long long)skipped, (unsigned long long)unmatched);
+	printf("%ld threads: index+parse %.1f ms, match %.1f ms\n", nthreads, (parsed - start) / 1e6, (matched - parsed) / 1e6);
+
+	for (size_t i = 0; i < num_targets; ++i)
+		free(all[i]);
+	free(all);
+	for (int i = 0; i < nthreads; ++i) {
+		free(parts[i].targets);
+		free(parts[i].reqs);
+		free(parts[i].table);
+	}
+	free(parts);
+	for (int i = 0; i < nchunks; ++i)
+		free(chunks[i].events);
+	free(chunks);
+	pcap_reader_close(r);
+	return 0;
+}
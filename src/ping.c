@@ -24,9 +24,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "iputils.h"
 #include "getopt_s.h"
 #include "ping.h"
+#include "ping_priv.h"
+#include "pattern.h"
+#include "capture.h"
 
 #ifndef EPICS
 #define epicsThreadSleep(x) usleep(x * 1e6)
@@ -35,36 +42,6 @@
 #include <epicsThread.h>
 #endif
 
-// Why on earth is this missing from RTEMS??? Not in limits.h or stdint.h????
-#ifndef UINT64_MAX
-#	define UINT64_MAX 0xffffffffffffffffULL
-#endif
-
-// Not available on RTEMS either, but that's okay...
-#ifndef MSG_DONTWAIT
-#	define MSG_DONTWAIT 0
-#endif
-
-#if defined(__rtems__)
-#	define USE_RAW_SOCK 1
-#endif
-#define USE_RAW_SOCK 1
-
-struct ping_ctx {
-	int fd;
-	struct sockaddr_in addr;
-};
-
-struct __attribute__((packed)) ping_packet {
-    struct icmp icmp;
-    uint32_t sec;
-    uint32_t nsec;
-    char payload[];
-};
-
-static bool _icmp_validate(const struct ping_opts* opts, struct ping_packet* packet, ssize_t recv_size);
-static void _generate_packet(const struct ping_opts* opts, struct ping_packet* packet, uint16_t seq, uint16_t ident);
-
 #ifdef EPICS
 
 #include <iocsh.h>
@@ -96,25 +73,75 @@ static struct timeval ms_to_tv(double ms) {
 	return tv;
 }
 
-static bool _ping_open(in_addr_t addr, const struct ping_opts* opts, struct ping_ctx* p) {
-#ifdef USE_RAW_SOCK
-    p->fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
-#else
-    p->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+/* Prefer an unprivileged ICMP datagram socket: the kernel demuxes replies by ident and strips the IP header.
+ * Raw sockets need root (or CAP_NET_RAW) and get a copy of every ICMP packet on the host */
+static int _ping_socket(const struct ping_opts* opts, bool* raw) {
+    int fd;
+#ifndef PING_RAW_ONLY
+    if (opts->sock_type != PING_SOCK_RAW) {
+        fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+        if (fd >= 0) {
+            *raw = false;
+            return fd;
+        }
+        if (opts->sock_type == PING_SOCK_DGRAM) {
+            perror("ICMP datagram socket creation failed");
+#if __linux__
+            if (errno == EACCES || errno == EPERM)
+                printf("Datagram ICMP sockets may be enabled for all users with:\n sysctl -w net.ipv4.ping_group_range=\"0 2147483647\"\n");
 #endif
-    if (p->fd < 0) {
+            return -1;
+        }
+        if (opts->log_type >= PING_LOG_FULL)
+            printf("ICMP datagram sockets unavailable (%s), falling back to a raw socket\n", strerror(errno));
+    }
+#endif
+
+    *raw = true;
+    fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+    if (fd < 0) {
         perror("Socket creation failed");
-	#if __linux__
-		if (errno == EPERM) {
-			printf("Permissions issues on Linux may be fixed by allowing ICMP for all users:\n sysctl -w net.ipv4.ping_group_range=\"0 2147483647\"\n");
-		}
-	#endif
-        return false;
+#if __linux__
+        if (errno == EPERM)
+            printf("Raw sockets need root or CAP_NET_RAW. Unprivileged datagram ICMP sockets may be enabled with:\n sysctl -w net.ipv4.ping_group_range=\"0 2147483647\"\n");
+#endif
     }
+    return fd;
+}
+
+bool _ping_open(in_addr_t addr, const struct ping_opts* opts, uint16_t ident, struct ping_ctx* p) {
+    p->fd = _ping_socket(opts, &p->raw);
+    if (p->fd < 0)
+        return false;
     memset(&p->addr, 0, sizeof(p->addr));
     p->addr.sin_family = AF_INET;
     p->addr.sin_port = 5555;
     p->addr.sin_addr.s_addr = addr;
+    p->ident = ident;
+
+	/* Datagram sockets use the local port as the echo ident, whatever we put in the header */
+	if (!p->raw) {
+		struct sockaddr_in local;
+		memset(&local, 0, sizeof(local));
+		local.sin_family = AF_INET;
+		local.sin_port = ident; /* Raw, it goes on the wire as is just like icd_id */
+		if (bind(p->fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+			/* Ident taken by another socket, let the kernel pick a free one */
+			local.sin_port = 0;
+			if (bind(p->fd, (struct sockaddr*)&local, sizeof(local)) < 0) {
+				perror("Failed to bind ICMP socket");
+				close(p->fd);
+				return false;
+			}
+		}
+		socklen_t len = sizeof(local);
+		if (getsockname(p->fd, (struct sockaddr*)&local, &len) < 0) {
+			perror("Failed to get ICMP socket ident");
+			close(p->fd);
+			return false;
+		}
+		p->ident = local.sin_port;
+	}
 
 	struct timeval tv = ms_to_tv(opts->read_timeout * 1e3);
 	if (setsockopt(p->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
@@ -134,7 +161,41 @@ static bool _ping_open(in_addr_t addr, const struct ping_opts* opts, struct ping
 }
 
 static void ping_help() {
-	printf("Usage: ping [-c count] [-i interval] [-s payload size] [-p pattern] [-l progress interval] [-q] ADDR\n");
+	printf("Usage: ping [-c count] [-i interval] [-r pps] [-W window] [-f] [-T sw|hw] [-s payload size] [-p pattern] [-P mode] [-o file] [-w file.pcap] [-l progress interval] [-q] ADDR...\n");
+	printf("  -r pps     Send at a fixed rate, same as -i 1/pps\n");
+	printf("  -W window  Keep at most this many echo requests in flight per host\n");
+	printf("  -f         Flood, send as fast as replies come back (or at -r pps)\n");
+	printf("  -T sw|hw   Measure RTT with kernel software or NIC hardware timestamps\n");
+	printf("  -o file    Log every request to file, CSV or binary records if the name ends in .bin\n");
+	printf("  -w file    Capture every request and reply to a pcap file, pcapng with packet comments if it ends in .pcapng\n");
+	printf("  -P mode    Payload: fill, incr, prbs7, prbs15, prbs31 or random (per packet). -p is the fill byte or seed\n");
+}
+
+void ping_stats_update(struct ping_stats* stats) {
+	const struct lat_hist* h = &stats->hist;
+	stats->minTime = h->count ? h->min / 1e6 : 0;
+	stats->maxTime = h->count ? h->max / 1e6 : 0;
+	stats->avgTime = lat_hist_mean(h) / 1e6;
+}
+
+void ping_stats_merge(struct ping_stats* dst, const struct ping_stats* src) {
+	dst->sent += src->sent;
+	dst->lost += src->lost;
+	dst->corrupted += src->corrupted;
+	dst->bad_bytes += src->bad_bytes;
+	dst->multi_bit += src->multi_bit;
+	dst->bits_set += src->bits_set;
+	dst->bits_cleared += src->bits_cleared;
+	dst->lost_bytes += src->lost_bytes;
+	dst->longest_burst = src->longest_burst > dst->longest_burst ? src->longest_burst : dst->longest_burst;
+	for (int i = 0; i < 8; ++i)
+		dst->bit_flips[i] += src->bit_flips[i];
+	for (int i = 0; i < PING_TS_NUM; ++i) {
+		dst->ts_tx[i] += src->ts_tx[i];
+		dst->ts_rx[i] += src->ts_rx[i];
+	}
+	lat_hist_merge(&dst->hist, &src->hist);
+	ping_stats_update(dst);
 }
 
 void icmp_ping_opts_init(struct ping_opts* opts) {
@@ -155,11 +216,26 @@ bool icmp_ping_cmd(int argc, char** argv) {
     int opt;
     getopt_state_t st;
     getopt_state_init(&st);
-    while ((opt = getopt_s(argc, argv, "i:c:ql:hp:s:", &st)) != -1) {
+    float pps = 0;
+    const char* record_path = NULL;
+    const char* capture_path = NULL;
+    while ((opt = getopt_s(argc, argv, "i:c:ql:hp:P:s:r:W:fT:o:w:", &st)) != -1) {
         switch(opt) {
         case 'i':
             opts.interval = atof(st.optarg);
             break;
+        case 'r':
+            pps = atof(st.optarg);
+            break;
+        case 'W':
+            opts.window = atoi(st.optarg);
+            break;
+        case 'f':
+            opts.flood = true;
+            break;
+        case 'T':
+            opts.timestamps = !strcmp(st.optarg, "hw") ? PING_TS_HARDWARE : PING_TS_SOFTWARE;
+            break;
         case 'c':
         {
             int n = atoi(st.optarg);
@@ -186,9 +262,23 @@ bool icmp_ping_cmd(int argc, char** argv) {
         case 'p':
             opts.pattern = strtol(st.optarg, NULL, 16);
             break;
+        case 'P':
+            opts.pattern_mode = pattern_parse(st.optarg);
+            if (opts.pattern_mode < 0) {
+                printf("Unknown pattern mode '%s'\n", st.optarg);
+                ping_help();
+                return false;
+            }
+            break;
         case 'q':
             opts.log_type = PING_LOG_NONE;
             break;
+        case 'o':
+            record_path = st.optarg;
+            break;
+        case 'w':
+            capture_path = st.optarg;
+            break;
         }
     }
 
@@ -197,191 +287,256 @@ bool icmp_ping_cmd(int argc, char** argv) {
 		return false;
 	}
 
-    opts.addr = inet_addr(argv[st.optind]);
-
-    struct in_addr a = {opts.addr};
-    printf("PING %s %d (%zu) bytes of data, pattern %d\n", inet_ntoa(a), opts.payload_size, opts.payload_size + sizeof(struct ping_packet), opts.pattern);
-
-	struct ping_stats stats;
-	return icmp_ping(&opts, &stats);
-}
-
-bool icmp_ping(const struct ping_opts* opts, struct ping_stats* stats) {
-
-	memset(stats, 0, sizeof(*stats));
-    stats->minTime = 999999;
-
-    struct ping_ctx ctx;
-    if (!_ping_open(opts->addr, opts, &ctx))
+    if (opts.interval <= 0 && !opts.flood && pps <= 0) {
+        printf("An interval of 0 needs -f, or a rate with -r\n");
         return false;
+    }
+    if (pps > 0) {
+        opts.interval = 1.f / pps;
+        opts.flood = false; /* Fixed rate flood is just a short interval */
+    }
+    /* Flooding is too fast for a line per packet */
+    if ((opts.flood || pps > 0) && opts.log_type == PING_LOG_FULL)
+        opts.log_type = PING_LOG_MINIMAL;
+
+    if (record_path) {
+        const size_t l = strlen(record_path);
+        const bool bin = l > 4 && !strcmp(record_path + l - 4, ".bin");
+        if (!(opts.recorder = ping_recorder_open(record_path, bin ? PING_RECORD_BINARY : PING_RECORD_CSV)))
+            return false;
+    }
+    if (capture_path && !(opts.capture = capture_open(capture_path))) {
+        ping_recorder_close(opts.recorder);
+        return false;
+    }
 
-    const uint16_t ident = 9239;
-    int lastseq = -1;
-    int finaltries = 15;
-
-	const bool quiet = opts->log_type < PING_LOG_FULL;
-    const bool silent = opts->log_type < PING_LOG_MINIMAL;
-    int64_t packetIdx = 0;
-
-    uint64_t seq;
-    for (seq = 0; seq < opts->num_packets; ++seq) {
-        union {
-            struct ping_packet msg;
-            char raw[65535];
-        } m;
+    bool ok;
+    /* More than one host, ping them all at once */
+    if (argc - st.optind > 1) {
+        const int num = argc - st.optind;
+        in_addr_t* addrs = calloc(num, sizeof(in_addr_t));
+        struct ping_stats* stats = calloc(num, sizeof(struct ping_stats));
+        if (!addrs || !stats) {
+            printf("Out of memory\n");
+            ok = false;
+        }
+        else {
+            for (int i = 0; i < num; ++i)
+                addrs[i] = inet_addr(argv[st.optind + i]);
 
-        const size_t packet_size = sizeof(struct ping_packet) + opts->payload_size;
-        _generate_packet(opts, &m.msg, seq, ident);
+            printf("PING %d hosts %d (%zu) bytes of data, pattern %s 0x%X\n", num, opts.payload_size, opts.payload_size + sizeof(struct ping_packet),
+                pattern_name(opts.pattern_mode), opts.pattern);
 
-        if (sendto(ctx.fd, &m.msg, packet_size, 0, (struct sockaddr*)&ctx.addr, sizeof(ctx.addr)) < 0) {
-            if (!quiet)
-                perror("failed");
+            ok = icmp_ping_multi(&opts, addrs, num, stats);
         }
-        stats->lost++;
-        stats->sent++;
+        free(addrs);
+        free(stats);
+    }
+    else {
+        opts.addr = inet_addr(argv[st.optind]);
 
-        // Store time, so we can compute how long to sleep for
-        struct timespec recv_start = time_now();
+        struct in_addr a = {opts.addr};
+        printf("PING %s %d (%zu) bytes of data, pattern %s 0x%X\n", inet_ntoa(a), opts.payload_size, opts.payload_size + sizeof(struct ping_packet),
+            pattern_name(opts.pattern_mode), opts.pattern);
 
-        // Recv some ICMP packets, accounting for some out of order delivery
-recvagain:
-        while(1) {
+        struct ping_stats stats;
+        ok = icmp_ping(&opts, &stats);
+    }
 
-            struct timespec recv_now = time_now();
-            if (time_diff(&recv_now, &recv_start) >= opts->interval) {
-                break;
-            }
+    ping_recorder_close(opts.recorder);
+    capture_close(opts.capture);
+    return ok;
+}
 
-            struct sockaddr_in fromaddr;
-            socklen_t fromsize = sizeof(fromaddr);
-            ssize_t ret;
+bool icmp_ping(const struct ping_opts* opts, struct ping_stats* stats) {
+    return icmp_ping_multi(opts, &opts->addr, 1, stats);
+}
 
-            // Recv logic is a bit more convoluted when using SOCK_RAW. We recv a full IP frame instead of just the payload
-            struct ip* ipf = (struct ip*)m.raw;
+/* Offset of the first byte where a and b differ, len if they are the same */
+static size_t _first_mismatch(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= len; i += 64) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        for (int j = 16; j < 64; j += 16)
+            eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + j)),
+                _mm_loadu_si128((const __m128i*)(b + i + j))));
+        if (_mm_movemask_epi8(eq) != 0xFFFF)
+            break;
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+            break;
+    }
+    for (; i < len && a[i] == b[i]; ++i)
+        ;
+    return i;
+}
 
-            const size_t recv_size = packet_size + sizeof(struct ip);
-            if ((ret = recvfrom(ctx.fd, m.raw, recv_size, 0, (struct sockaddr*)&fromaddr, &fromsize)) < (ssize_t)(sizeof(struct ping_packet))) {
-                // No more data left, bail out!
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    break;
+/* Tally the bad bytes from `start` on. Runs of good bytes are skipped a word at a time */
+static void _count_corruption(const uint8_t* got, const uint8_t* expected, size_t start, size_t len,
+    struct ping_corruption* c) {
+    c->first = start;
+    size_t burst = 0;
+    for (size_t i = start; i < len;) {
+        if (i + 8 <= len) {
+            uint64_t x, y;
+            memcpy(&x, got + i, 8);
+            memcpy(&y, expected + i, 8);
+            if (x == y) {
+                burst = 0;
+                i += 8;
                 continue;
             }
-
-        #ifdef USE_RAW_SOCK
-            ret -= sizeof(struct ip);
-        #endif
-
-            // Certain servers may be configured to truncate ICMP requests above a certain size (i.e. google.com)
-            int trunc = ret < sizeof(struct ping_packet);
-
-            struct timespec now = time_now();
-
-            struct ping_packet* rmsg = 
-        #if USE_RAW_SOCK
-                (struct ping_packet*)(m.raw + (ipf->ip_hl * 4)); /* hl = number of 32-bit words in header */
-        #else
-                (struct ping_packet*)m.raw;
-        #endif
-
-            // Filter out any non-echo requests, or messages we don't own
-            if (rmsg->icmp.icmp_type != ICMP_ECHOREPLY || rmsg->icmp.icmp_hun.ih_idseq.icd_id != ident)
-                continue;
-
-            // Validate ICMP packet
-            if (!_icmp_validate(opts, rmsg, ret)) {
-                if (!silent)
-                    printf("malformed ICMP packet with SEQ %d!\n", rmsg->icmp.icmp_hun.ih_idseq.icd_seq);
-                ++stats->corrupted;
+        }
+        const size_t end = i + 8 < len ? i + 8 : len;
+        for (; i < end; ++i) {
+            const uint8_t diff = got[i] ^ expected[i];
+            if (!diff) {
+                burst = 0;
                 continue;
             }
-
-            struct timespec ts = {rmsg->sec, rmsg->nsec};
-            float diffms = time_diff(&now, &ts) * 1000.f;
-            stats->avgTime = ((packetIdx) * stats->avgTime + diffms) / (packetIdx+1);
-            stats->minTime = diffms < stats->minTime ? diffms : stats->minTime;
-            stats->maxTime = diffms > stats->maxTime ? diffms : stats->maxTime;
-            packetIdx++;
-
-            if (!quiet)
-                printf("%ld bytes from %s: icmp_seq=%d time=%.2f ms %s%s%s\n", 
-                    (long int)(ret - ipf->ip_hl * 4), inet_ntoa(fromaddr.sin_addr), rmsg->icmp.icmp_hun.ih_idseq.icd_seq, diffms,
-                    (lastseq != (int)(rmsg->icmp.icmp_hun.ih_idseq.icd_seq) - 1) ? "(OUT OF ORDER)" : "",
-                    stats->lost == 0 ? "(DUP)" : "", trunc ? "(TRUNC)" : "");
-
-            lastseq = rmsg->icmp.icmp_hun.ih_idseq.icd_seq;
-            --stats->lost;
+            if (c->bad_bytes < PING_CORRUPT_OFFSETS)
+                c->offsets[c->bad_bytes] = i;
+            ++c->bad_bytes;
+            c->last = i;
+
+            /* Consecutive bad bytes are one burst */
+            if (!burst++)
+                ++c->bursts;
+            c->longest_burst = burst > c->longest_burst ? burst : c->longest_burst;
+
+            if (diff & (diff - 1))
+                ++c->multi_bit;
+            c->bits_set += __builtin_popcount(diff & got[i]);
+            c->bits_cleared += __builtin_popcount(diff & expected[i]);
+            for (int bit = 0; bit < 8; ++bit)
+                c->flips[bit] += (diff >> bit) & 1;
         }
+    }
+}
 
-        // Display progress every so often
-        if (!silent && quiet && opts->progress > 0 && seq % opts->progress == 0) {
-            printf("%llu sent so far, %lli in-flight (or lost), %lli corrupted, icmp_seq=%llu\n",
-                (long long unsigned)seq+1, (long long)stats->lost, (long long)stats->corrupted, (long long unsigned)seq);
-            printf("  min=%.2f ms, max=%.2f ms, avg=%.2f ms\n", stats->minTime, stats->maxTime, stats->avgTime);
-        }
+bool _icmp_validate(const char* expected, size_t expected_size, struct ping_packet* packet, ssize_t recv_size,
+    struct ping_corruption* c) {
+    memset(c, 0, sizeof(*c));
 
-        struct timespec recv_end = time_now();
+    const uint16_t sum = packet->icmp.icmp_cksum;
+    packet->icmp.icmp_cksum = 0;
+    c->bad_cksum = sum != ip_cksum(packet, recv_size);
+    packet->icmp.icmp_cksum = sum;
 
-        // We're about to exit, but we could still have packets in-flight! Wait for them
-        if (stats->lost && seq == opts->num_packets-1 && finaltries-- > 0) {
-            epicsThreadSleep(0.001);
-            goto recvagain;
-        }
+    // Truncated replies only get the part that came back checked, nothing if the header itself got cut short
+    const ssize_t got_payload = recv_size - (ssize_t)sizeof(struct ping_packet);
+    size_t toCheck = got_payload > 0 ? (size_t)got_payload : 0;
+    if (toCheck > expected_size)
+        toCheck = expected_size;
+    c->lost_bytes = expected_size - toCheck;
 
-        double to_sleep = opts->interval - time_diff(&recv_end, &recv_start);
-        if (to_sleep > 0 && opts->num_packets-1 != seq)
-            epicsThreadSleep(to_sleep);
-    }
+    const uint8_t* got = (const uint8_t*)packet->payload;
+    const uint8_t* exp = (const uint8_t*)expected;
+    const size_t first = _first_mismatch(got, exp, toCheck);
+    if (first < toCheck)
+        _count_corruption(got, exp, first, toCheck, c);
+
+    return !c->bad_cksum && c->bad_bytes == 0;
+}
 
-    close(ctx.fd);
+/* One line summary of a corrupted reply, so a mangled jumbo packet doesn't flood the console */
+void _ping_corruption_print(const char* name, uint16_t seq, const struct ping_corruption* c) {
+    char lost[48] = "";
+    if (c->lost_bytes)
+        snprintf(lost, sizeof(lost), ", %u bytes missing at the end", c->lost_bytes);
 
-    // Print stats
-    if (!silent) {
-        printf("%llu packets transmitted, %llu received, %lld corrupted, %.2f%% packet loss\n", (long long unsigned)seq, 
-            (long long unsigned)seq - stats->lost, (long long)stats->corrupted, 100.f * ((float)(stats->lost) / seq));
-        printf("min=%.2f ms, max=%.2f ms, avg=%.2f ms\n", stats->minTime, stats->maxTime, stats->avgTime);
+    if (!c->bad_bytes) {
+        printf("corrupted reply from %s icmp_seq=%d: bad checksum, payload intact%s\n", name, seq, lost);
+        return;
     }
-    return stats->corrupted == 0 && stats->lost == 0;
+
+    char offsets[PING_CORRUPT_OFFSETS * 8 + 8] = "";
+    size_t n = 0;
+    const uint32_t shown = c->bad_bytes < PING_CORRUPT_OFFSETS ? c->bad_bytes : PING_CORRUPT_OFFSETS;
+    for (uint32_t i = 0; i < shown; ++i)
+        n += snprintf(offsets + n, sizeof(offsets) - n, "%s%u", i ? "," : "", c->offsets[i]);
+    if (c->bad_bytes > shown)
+        snprintf(offsets + n, sizeof(offsets) - n, ",...");
+
+    printf("corrupted reply from %s icmp_seq=%d:%s %u bad bytes at %s (%u..%u), %u bursts (longest %u), %u multi-bit, "
+        "bits set/cleared=%u/%u, flips b0-b7=%u/%u/%u/%u/%u/%u/%u/%u%s\n",
+        name, seq, c->bad_cksum ? " bad checksum," : "", c->bad_bytes, offsets, c->first, c->last, c->bursts,
+        c->longest_burst, c->multi_bit, c->bits_set, c->bits_cleared, c->flips[0], c->flips[1], c->flips[2],
+        c->flips[3], c->flips[4], c->flips[5], c->flips[6], c->flips[7], lost);
 }
 
-static bool _icmp_validate(const struct ping_opts* opts, struct ping_packet* packet, ssize_t recv_size) {
-    uint16_t sum = packet->icmp.icmp_cksum;
-    packet->icmp.icmp_cksum = 0;
-    const uint16_t actualSum = ip_cksum(packet, recv_size);
+/* Fold one reply's corruption into the running totals */
+void _ping_corruption_add(struct ping_stats* stats, const struct ping_corruption* c) {
+    ++stats->corrupted;
+    stats->bad_bytes += c->bad_bytes;
+    stats->multi_bit += c->multi_bit;
+    stats->bits_set += c->bits_set;
+    stats->bits_cleared += c->bits_cleared;
+    stats->lost_bytes += c->lost_bytes;
+    stats->longest_burst = c->longest_burst > stats->longest_burst ? c->longest_burst : stats->longest_burst;
+    for (int i = 0; i < 8; ++i)
+        stats->bit_flips[i] += c->flips[i];
+}
 
-    if (sum != actualSum) {
-        printf("bad checksum for icmp_seq=%d: packet checksum=0x%X, expected checksum=0x%X\n",
-            packet->icmp.icmp_hun.ih_idseq.icd_seq, sum, actualSum);
-    }
+bool _ping_template_init(struct ping_template* tpl, const struct ping_opts* opts, uint16_t ident) {
+    memset(tpl, 0, sizeof(*tpl));
+    tpl->payload_size = opts->payload_size;
+    tpl->mode = opts->pattern_mode;
+    tpl->seed = opts->pattern;
+    tpl->payload = malloc(opts->payload_size + 1);
+    tpl->scratch = pattern_per_packet(tpl->mode) ? malloc(opts->payload_size + 1) : NULL;
+    if (!tpl->payload || (pattern_per_packet(tpl->mode) && !tpl->scratch))
+        return false;
+    pattern_fill(tpl->mode, tpl->seed, 0, tpl->payload, opts->payload_size);
+    tpl->payload_sum = ip_cksum_partial(tpl->payload, tpl->payload_size);
 
-    packet->icmp.icmp_cksum = sum;
+    tpl->hdr.icmp.icmp_type = ICMP_ECHO;
+    tpl->hdr.icmp.icmp_code = 0;
+    tpl->hdr.icmp.icmp_hun.ih_idseq.icd_id = ident;
+
+    /* Header is an even number of bytes, so the two sums combine */
+    tpl->hdr.icmp.icmp_cksum = ~ones_sum(ip_cksum_partial(&tpl->hdr, sizeof(tpl->hdr)), tpl->payload_sum);
+    return true;
+}
 
-    const ssize_t toCheck = recv_size - sizeof(struct ping_packet);
+void _ping_template_free(struct ping_template* tpl) {
+    free(tpl->payload);
+    free(tpl->scratch);
+    tpl->payload = NULL;
+    tpl->scratch = NULL;
+}
 
-    bool ok = true;
-    for (int i = 0; i < toCheck; ++i) {
-        if ((char)opts->pattern != packet->payload[i]) {
-            printf("Data failed to validate, expected %d at byte %d, but got %d insteaad!\n", opts->pattern, i, packet->payload[i]);
-            ok = false;
-        }
-    }
+void _ping_template_fill_payload(const struct ping_template* tpl, struct ping_packet* hdr, uint16_t seq, char* payload) {
+    pattern_fill(tpl->mode, tpl->seed, seq, payload, tpl->payload_size);
+    hdr->icmp.icmp_cksum = ip_cksum_adjust16(hdr->icmp.icmp_cksum, tpl->payload_sum,
+        ip_cksum_partial(payload, tpl->payload_size));
+}
 
-    return sum == actualSum && ok;
+const char* _ping_template_expected(struct ping_template* tpl, uint16_t seq) {
+    if (!tpl->scratch)
+        return tpl->payload;
+    pattern_fill(tpl->mode, tpl->seed, seq, tpl->scratch, tpl->payload_size);
+    return tpl->scratch;
 }
 
-static void _generate_packet(const struct ping_opts* opts, struct ping_packet* msg, uint16_t seq, uint16_t ident) {
-    memset(msg, 0, sizeof(*msg));
-    msg->icmp.icmp_type = ICMP_ECHO;
-    msg->icmp.icmp_code = 0;
-    msg->icmp.icmp_hun.ih_idseq.icd_id = ident;
+void _ping_template_fill(const struct ping_template* tpl, struct ping_packet* msg, uint16_t seq) {
+    *msg = tpl->hdr;
     msg->icmp.icmp_hun.ih_idseq.icd_seq = seq;
-    memset(msg->payload, opts->pattern, opts->payload_size);
 
     struct timespec sentat = time_now();
 
     msg->sec = sentat.tv_sec;
     msg->nsec = sentat.tv_nsec;
 
-    msg->icmp.icmp_cksum = ip_cksum(msg, sizeof(*msg) + opts->payload_size);
+    uint16_t sum = ip_cksum_adjust16(tpl->hdr.icmp.icmp_cksum, 0, seq);
+    sum = ip_cksum_adjust32(sum, 0, msg->sec);
+    msg->icmp.icmp_cksum = ip_cksum_adjust32(sum, 0, msg->nsec);
 }
 
 #ifdef PING_MAIN
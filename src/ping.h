@@ -7,12 +7,39 @@
 
 #include <arpa/inet.h>
 
+#include "histogram.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #include <stdbool.h>
 
+enum ping_ts_source {
+	PING_TS_USER = 0,	/* clock_gettime() around the socket calls */
+	PING_TS_SOFTWARE,	/* Kernel software timestamps */
+	PING_TS_HARDWARE,	/* NIC hardware timestamps, the interface must have them enabled */
+	PING_TS_NUM
+};
+
+#define PING_CORRUPT_OFFSETS 8
+
+/* What was wrong with one corrupted echo reply */
+struct ping_corruption {
+	bool bad_cksum;
+	uint32_t bad_bytes; /* Payload bytes that differ from what we sent */
+	uint32_t lost_bytes; /* Payload missing from the end of a truncated reply */
+	uint32_t first; /* Payload offsets of the first and last bad byte */
+	uint32_t last;
+	uint32_t offsets[PING_CORRUPT_OFFSETS]; /* Offsets of the first few bad bytes */
+	uint32_t bursts; /* Runs of consecutive bad bytes */
+	uint32_t longest_burst;
+	uint32_t flips[8]; /* Flipped bits by position in the byte, 0 = LSB. A stuck bit shows up as one hot position */
+	uint32_t bits_set; /* Flips from 0 to 1 and from 1 to 0, stuck-at faults only go one way */
+	uint32_t bits_cleared;
+	uint32_t multi_bit; /* Bad bytes with more than one flipped bit */
+};
+
 struct ping_stats {
 	float minTime;
 	float maxTime;
@@ -20,8 +47,80 @@ struct ping_stats {
 	int sent;
 	int lost;
 	int corrupted;
+	int ts_tx[PING_TS_NUM]; /* Samples by the source of their send timestamp */
+	int ts_rx[PING_TS_NUM]; /* Samples by the source of their receive timestamp */
+	struct lat_hist hist; /* Every RTT sample, min/max/avgTime are derived from this */
+	uint64_t bad_bytes; /* Corrupted payload bytes over all replies */
+	uint64_t bit_flips[8]; /* Sum of ping_corruption.flips over all replies */
+	uint64_t multi_bit;
+	uint64_t bits_set;
+	uint64_t bits_cleared;
+	uint64_t lost_bytes;
+	uint32_t longest_burst;
+};
+
+enum ping_sock_type {
+	PING_SOCK_AUTO = 0,	/* Datagram socket if the system allows it, raw otherwise */
+	PING_SOCK_DGRAM,	/* Unprivileged ICMP datagram socket (Linux: net.ipv4.ping_group_range) */
+	PING_SOCK_RAW,		/* Raw socket, needs root or CAP_NET_RAW */
+};
+
+enum ping_record_flags {
+	PING_REC_LOST = 1 << 0,		/* No reply before the request's slot was reused or the run ended */
+	PING_REC_DUP = 1 << 1,
+	PING_REC_OUT_OF_ORDER = 1 << 2,
+	PING_REC_TRUNC = 1 << 3,
+	PING_REC_CORRUPT = 1 << 4,
+	PING_REC_LATE = 1 << 5,		/* Reply to a request that had already timed out */
 };
 
+/**
+ * One echo request and what became of it, times are CLOCK_REALTIME ns.
+ * Binary record files are the magic "PINGREC1", a uint32 record size, then these in host byte order.
+ */
+struct ping_record {
+	uint64_t sent_ns;
+	uint64_t recv_ns;	/* 0 if lost */
+	uint64_t rtt_ns;	/* From the most precise timestamps available, may differ from recv_ns - sent_ns */
+	uint32_t target;	/* in_addr_t, network byte order */
+	uint16_t seq;
+	uint16_t size;		/* ICMP bytes received */
+	uint8_t flags;		/* enum ping_record_flags */
+	uint8_t ts;		/* enum ping_ts_source of the RTT */
+	uint8_t pad[6];
+};
+
+/* What on_record wants the engine to do next */
+enum ping_record_action {
+	PING_RECORD_CONTINUE = 0,
+	PING_RECORD_STOP_TARGET,	/* Stop sending to this record's target, the others carry on */
+	PING_RECORD_STOP,			/* Stop sending to every target */
+};
+
+enum ping_record_format {
+	PING_RECORD_CSV = 0,
+	PING_RECORD_BINARY,
+};
+
+/**
+ * Writes ping records to a file from a background thread. The ping engine hands records over through a lock-free
+ * ring, so logging every sample never blocks the timing path. If the writer falls behind records are dropped
+ * and counted. Records must only be pushed from one thread at a time.
+ */
+struct ping_recorder;
+
+struct ping_recorder* ping_recorder_open(const char* path, int format);
+
+/* Returns false if the ring is full and the record was dropped */
+bool ping_recorder_push(struct ping_recorder* r, const struct ping_record* rec);
+
+uint64_t ping_recorder_dropped(const struct ping_recorder* r);
+
+/* Writes out everything still queued, stops the thread and closes the file */
+void ping_recorder_close(struct ping_recorder* r);
+
+struct capture;
+
 enum LogType {
 	PING_LOG_NONE = 0,
 	PING_LOG_MINIMAL,
@@ -38,10 +137,31 @@ struct ping_opts {
 	int64_t num_packets; /* -1 = infinite */
 	int log_type;
 	int progress; /* For use with PING_LOG_MINIMAL, every `progress` packets, display status */
-	uint8_t pattern;
+	uint8_t pattern; /* Fill byte or seed of pattern_mode */
+	int pattern_mode; /* enum pattern_mode in pattern.h */
 	uint16_t payload_size;
+	int window; /* Max echo requests in flight per target, 0 = unlimited */
+	bool flood; /* Ignore interval and send as soon as the window has room (defaults to a window of 1) */
+	int timestamps; /* Preferred timestamp source for RTTs, enum ping_ts_source. Falls back to what the platform has */
+	int sock_type; /* enum ping_sock_type */
+	struct ping_recorder* recorder; /* Every request's outcome is pushed here if set */
+	struct capture* capture; /* Every packet sent and received is captured here if set, see capture.h */
+	/**
+	 * Called with the outcome of every request as soon as it is known, on the thread running the engine.
+	 * Requests are reported lost once they are read_timeout old, a reply that shows up after that comes
+	 * in flagged PING_REC_LATE. Returns an enum ping_record_action, the run ends once nothing is sending
+	 * and the stragglers are in
+	 */
+	int (*on_record)(void* arg, const struct ping_record* rec);
+	void* on_record_arg;
 };
 
+/* Refresh min/max/avgTime from the histogram */
+void ping_stats_update(struct ping_stats* stats);
+
+/* Accumulate the results of another run (or another target) into dst */
+void ping_stats_merge(struct ping_stats* dst, const struct ping_stats* src);
+
 /* Fill ping_opts struct with defaults */
 void icmp_ping_opts_init(struct ping_opts* opts);
 
@@ -49,6 +169,32 @@ bool icmp_ping_cmd(int argc, char** argv);
 
 bool icmp_ping(const struct ping_opts* opts, struct ping_stats* stats);
 
+/**
+ * Ping several hosts at once from a single socket. Every address gets opts->num_packets echo requests,
+ * opts->interval seconds apart, with the targets staggered across the interval. The aggregate send rate is
+ * num_addrs / interval, so a sweep takes about as long as pinging one host.
+ * opts->addr is ignored, stats must have room for num_addrs entries (filled in the same order as addrs).
+ * Returns true if no target lost or corrupted any packets.
+ */
+bool icmp_ping_multi(const struct ping_opts* opts, const in_addr_t* addrs, int num_addrs, struct ping_stats* stats);
+
+/**
+ * A ping session owns an ICMP socket and an ident no other session in the process shares, so concurrent pings
+ * don't see each other's replies. Open it once, then run as many bursts as needed, each with its own opts
+ * (payload size, pattern, interval, ...). The timestamp source is picked from the opts given to open.
+ * A session must only be used by one thread at a time.
+ */
+struct ping_session;
+
+/* Returns NULL if the socket can't be opened */
+struct ping_session* ping_session_open(const struct ping_opts* opts);
+
+/* Same as icmp_ping_multi, on the session's socket */
+bool ping_session_run(struct ping_session* s, const struct ping_opts* opts, const in_addr_t* addrs, int num_addrs,
+	struct ping_stats* stats);
+
+void ping_session_close(struct ping_session* s);
+
 #ifdef __cplusplus
 }
 #endif
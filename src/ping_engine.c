@@ -0,0 +1,1106 @@
+/**
+ * ping_engine.c -- Event driven ping engine, pings many targets from a single ICMP socket
+ */
+#ifndef _GNU_SOURCE
+#	define _GNU_SOURCE /* sendmmsg/recvmmsg */
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#	include <linux/errqueue.h>
+#	include <linux/net_tstamp.h>
+#	include <sys/timerfd.h>
+#	define HAVE_TIMERFD 1
+#endif
+
+#include "iputils.h"
+#include "ping.h"
+#include "ping_priv.h"
+#include "pattern.h"
+#include "capture.h"
+
+/* Batched socket calls, Linux only. RTEMS and the BSDs fall back to one call per packet */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#	define HAVE_MMSG 1
+#endif
+
+#define PING_BATCH 64		/* Max packets per sendmmsg/recvmmsg */
+#define PING_BATCH_BYTES (1024 * 1024) /* Memory budget for each of the tx and rx batch buffers */
+
+/* Kernel send timestamps need SO_TIMESTAMPING and the error queue, Linux only */
+#if defined(__linux__) && defined(SO_TIMESTAMPING)
+#	define HAVE_TX_TIMESTAMPS 1
+#endif
+
+#define PING_CMSG_SIZE 256	/* Control buffer per received packet, plenty for the timestamp messages */
+#define PING_TXKEY_RING 4096	/* Outstanding kernel send timestamp ids we can map back to a request */
+
+#define PING_MIN_SLOTS 64
+#define PING_MAX_SLOTS 65536 /* One per sequence number */
+
+enum ping_slot_state {
+	PING_SLOT_FREE = 0,
+	PING_SLOT_PENDING,	/* Sent, waiting for the reply */
+	PING_SLOT_EXPIRED,	/* Timed out, no longer counts against the window but a late reply is still accepted */
+	PING_SLOT_LOST,		/* Expired and already recorded as lost, a late reply is still accepted */
+	PING_SLOT_DONE,		/* Reply received (or rejected as corrupt) */
+};
+
+/* Tracks a single echo request until its reply shows up */
+struct ping_slot {
+	uint64_t sent;		/* Monotonic ns */
+	uint64_t sent_rt;	/* CLOCK_REALTIME ns, only with kernel timestamps (they use the same clock) */
+	uint64_t tx_sw;		/* Kernel software send timestamp, 0 if none */
+	uint64_t tx_hw;		/* NIC send timestamp, 0 if none */
+	uint16_t seq;
+	uint8_t state;
+};
+
+/* Receive timestamps pulled out of the control messages, realtime ns, 0 if not present */
+struct ping_rxts {
+	uint64_t sw;
+	uint64_t hw;
+};
+
+/* Maps a kernel send timestamp id back to its request */
+struct ping_txkey {
+	int target;
+	uint16_t seq;
+};
+
+struct ping_target {
+	struct sockaddr_in addr;
+	struct ping_stats* stats;
+	uint64_t next_send;	/* Absolute deadline of the next echo request */
+	uint64_t seq;		/* Requests sent so far this run */
+	uint64_t tail;		/* Oldest request that may still be in flight */
+	int inflight;		/* Requests sent and neither answered nor expired */
+	bool stopped;		/* opts->on_record is done with this target */
+	int received;
+	int lastseq;
+	struct ping_slot* slots;	/* Indexed by seq & slot_mask */
+	uint32_t slot_mask;
+	char name[INET_ADDRSTRLEN];
+	in_addr_t src;		/* Local address requests leave from, only looked up when capturing */
+};
+
+/* Socket, buffers and kernel state live for the whole session, targets and the template only for one run */
+struct ping_engine {
+	const struct ping_opts* opts;
+	struct ping_ctx ctx;
+	uint64_t interval;	/* Send interval per target in ns, 0 for flood */
+	uint64_t timeout;	/* Age at which an unanswered request stops counting against the window */
+	int window;		/* Max requests in flight per target, 0 = unlimited */
+	uint16_t ident;
+	uint16_t seq_base;	/* Wire seq of each target's first request this run. Runs don't reuse seqs, so late replies can't match */
+	struct ping_target* targets;
+	int num_targets;
+	int* table;		/* Open addressed in_addr_t -> target index map */
+	uint32_t table_mask;
+	int64_t outstanding;	/* Requests sent that are still waiting for a reply */
+	bool stop;		/* opts->on_record asked for the run to end */
+	uint64_t last_send;
+	uint64_t duration;
+
+	int64_t rt_offset;	/* CLOCK_REALTIME - CLOCK_MONOTONIC in ns, for records and captures */
+	uint8_t ttl;		/* TTL our requests go out with, for captures */
+	int timer_fd;		/* Wakes poll() at send deadlines with ns precision, -1 where there's no timerfd */
+	struct lat_hist send_err;	/* How late each scheduled send went out, ns */
+
+	bool use_mmsg;		/* Cleared at runtime if the kernel turns out not to have sendmmsg/recvmmsg */
+	int timestamps;		/* Kernel timestamp source we managed to enable, enum ping_ts_source */
+	bool tx_timestamps;	/* Send timestamps come back on the error queue */
+	uint32_t tx_key;	/* Id the kernel gives the next send timestamp */
+	struct ping_txkey* tx_keys;
+
+	/* Echo requests queued up for the next flush, header only. The payload is shared from the template */
+	struct ping_template tpl;
+	struct ping_packet* tx;
+	char* tx_payload;	/* Payload of each queued request for per packet patterns, NULL when they share the template's */
+	int tx_batch;
+	int tx_count;
+	struct iovec* tx_iov;
+	const struct sockaddr_in** tx_dst;
+	struct ping_txkey* tx_queued;
+
+	/* Preallocated ring of receive buffers, filled in one go by recvmmsg */
+	char* rx;
+	size_t rx_size;
+	int rx_batch;
+	struct iovec* rx_iov;
+	struct sockaddr_in* rx_from;
+	char* rx_cmsg;
+
+#ifdef HAVE_MMSG
+	struct mmsghdr* tx_msgs;
+	struct mmsghdr* rx_msgs;
+#endif
+};
+
+struct ping_session {
+	struct ping_engine engine;
+};
+
+static uint32_t _pow2_ceil(uint32_t v) {
+	uint32_t r = 1;
+	while (r < v)
+		r <<= 1;
+	return r;
+}
+
+static uint32_t _addr_hash(in_addr_t addr) {
+	return (uint32_t)addr * 2654435761U;
+}
+
+static struct ping_target* _engine_lookup(struct ping_engine* e, in_addr_t addr) {
+	for (uint32_t i = _addr_hash(addr) & e->table_mask;; i = (i + 1) & e->table_mask) {
+		if (e->table[i] < 0)
+			return NULL;
+		if (e->targets[e->table[i]].addr.sin_addr.s_addr == addr)
+			return &e->targets[e->table[i]];
+	}
+}
+
+/* Wire seq of target's n-th request this run */
+static uint16_t _engine_seq(const struct ping_engine* e, uint64_t n) {
+	return (uint16_t)(e->seq_base + n);
+}
+
+/* Idents have to differ between sessions, raw sockets get every echo reply that reaches the host */
+static uint16_t _engine_ident() {
+	static uint32_t counter = 0;
+	const uint32_t n = __sync_fetch_and_add(&counter, 1);
+	return (uint16_t)(getpid() * 2654435761U + n * 40503U);
+}
+
+/* Forget the targets of the last run, the socket stays open for the next one */
+static void _engine_release(struct ping_engine* e) {
+	uint64_t maxseq = 0;
+	if (e->targets) {
+		for (int i = 0; i < e->num_targets; ++i) {
+			free(e->targets[i].slots);
+			maxseq = e->targets[i].seq > maxseq ? e->targets[i].seq : maxseq;
+		}
+	}
+	e->seq_base = _engine_seq(e, maxseq);
+	free(e->targets);
+	free(e->table);
+	_ping_template_free(&e->tpl);
+	free(e->tx_payload);
+	e->tx_payload = NULL;
+	e->targets = NULL;
+	e->table = NULL;
+	e->num_targets = 0;
+}
+
+static void _engine_free(struct ping_engine* e) {
+	_engine_release(e);
+	free(e->tx);
+	free(e->tx_iov);
+	free(e->tx_dst);
+	free(e->tx_queued);
+	free(e->tx_keys);
+	free(e->rx);
+	free(e->rx_iov);
+	free(e->rx_from);
+	free(e->rx_cmsg);
+#ifdef HAVE_MMSG
+	free(e->tx_msgs);
+	free(e->rx_msgs);
+#endif
+	if (e->ctx.fd >= 0)
+		close(e->ctx.fd);
+	if (e->timer_fd >= 0)
+		close(e->timer_fd);
+}
+
+/* Ask the kernel to timestamp packets for us, using the best mechanism the platform has */
+static bool _engine_timestamps(struct ping_engine* e) {
+	const bool quiet = e->opts->log_type < PING_LOG_MINIMAL;
+	int on = 1;
+
+#ifdef HAVE_TX_TIMESTAMPS
+	/* Send timestamps are matched to requests by the per-socket counter OPT_ID puts in ee_data */
+	const int swflags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+		| SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	const int hwflags = swflags | SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE;
+
+	e->tx_keys = calloc(PING_TXKEY_RING, sizeof(struct ping_txkey));
+	for (int hw = e->opts->timestamps == PING_TS_HARDWARE; e->tx_keys && hw >= 0; --hw) {
+		const int flags = hw ? hwflags : swflags;
+		if (setsockopt(e->ctx.fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0) {
+			e->timestamps = hw ? PING_TS_HARDWARE : PING_TS_SOFTWARE;
+			e->tx_timestamps = true;
+			return true;
+		}
+	}
+#endif
+
+#if defined(SO_TIMESTAMPNS)
+	if (setsockopt(e->ctx.fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) {
+		e->timestamps = PING_TS_SOFTWARE;
+		if (!quiet)
+			printf("Kernel send timestamps unavailable, using receive timestamps only\n");
+		return true;
+	}
+#endif
+
+#if defined(SO_TIMESTAMP)
+	if (setsockopt(e->ctx.fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) == 0) {
+		e->timestamps = PING_TS_SOFTWARE;
+		if (!quiet)
+			printf("Kernel send timestamps unavailable, using receive timestamps only\n");
+		return true;
+	}
+#endif
+
+	(void)on;
+	if (!quiet)
+		printf("Kernel timestamps unavailable, falling back to user space timestamps\n");
+	e->timestamps = PING_TS_USER;
+	return true;
+}
+
+/* Pull the kernel receive timestamps out of the control messages */
+static void _parse_rxts(struct msghdr* msg, struct ping_rxts* ts) {
+	ts->sw = ts->hw = 0;
+	for (struct cmsghdr* c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET)
+			continue;
+#ifdef SO_TIMESTAMPING
+		if (c->cmsg_type == SO_TIMESTAMPING) {
+			struct timespec tss[3];
+			memcpy(tss, CMSG_DATA(c), sizeof(tss));
+			ts->sw = timespec_to_ns(&tss[0]);
+			ts->hw = timespec_to_ns(&tss[2]);
+		}
+#endif
+#ifdef SO_TIMESTAMPNS
+		if (c->cmsg_type == SO_TIMESTAMPNS) {
+			struct timespec tp;
+			memcpy(&tp, CMSG_DATA(c), sizeof(tp));
+			ts->sw = timespec_to_ns(&tp);
+		}
+#endif
+#ifdef SO_TIMESTAMP
+		if (c->cmsg_type == SO_TIMESTAMP) {
+			struct timeval tv;
+			memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+			ts->sw = (uint64_t)tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000ULL;
+		}
+#endif
+	}
+}
+
+/* Set up everything that outlives a single run: socket, ident, batch buffers and timestamping */
+static bool _engine_open(struct ping_engine* e, const struct ping_opts* opts) {
+	memset(e, 0, sizeof(*e));
+	e->ctx.fd = -1;
+	e->timer_fd = -1;
+	e->opts = opts;
+	e->ident = _engine_ident();
+
+	e->tx_batch = PING_BATCH;
+	e->tx = calloc(e->tx_batch, sizeof(struct ping_packet));
+	e->tx_iov = calloc(e->tx_batch * 2, sizeof(struct iovec));
+	e->tx_dst = calloc(e->tx_batch, sizeof(struct sockaddr_in*));
+	e->tx_queued = calloc(e->tx_batch, sizeof(struct ping_txkey));
+
+	/* The receive buffers themselves depend on the payload size, they're sized per run */
+	e->rx_iov = calloc(PING_BATCH, sizeof(struct iovec));
+	e->rx_from = calloc(PING_BATCH, sizeof(struct sockaddr_in));
+	e->rx_cmsg = calloc(PING_BATCH, PING_CMSG_SIZE);
+
+	if (!e->tx || !e->tx_iov || !e->tx_dst || !e->tx_queued || !e->rx_iov || !e->rx_from || !e->rx_cmsg) {
+		printf("Out of memory\n");
+		return false;
+	}
+
+	for (int i = 0; i < e->tx_batch; ++i) {
+		e->tx_iov[i * 2].iov_base = &e->tx[i];
+		e->tx_iov[i * 2].iov_len = sizeof(struct ping_packet);
+	}
+
+#ifdef HAVE_MMSG
+	e->tx_msgs = calloc(e->tx_batch, sizeof(struct mmsghdr));
+	e->rx_msgs = calloc(PING_BATCH, sizeof(struct mmsghdr));
+	if (!e->tx_msgs || !e->rx_msgs) {
+		printf("Out of memory\n");
+		return false;
+	}
+	for (int i = 0; i < e->tx_batch; ++i) {
+		e->tx_msgs[i].msg_hdr.msg_iov = &e->tx_iov[i * 2];
+		e->tx_msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+	for (int i = 0; i < PING_BATCH; ++i) {
+		e->rx_msgs[i].msg_hdr.msg_iov = &e->rx_iov[i];
+		e->rx_msgs[i].msg_hdr.msg_iovlen = 1;
+		e->rx_msgs[i].msg_hdr.msg_name = &e->rx_from[i];
+		e->rx_msgs[i].msg_hdr.msg_control = e->rx_cmsg + i * PING_CMSG_SIZE;
+	}
+	e->use_mmsg = true;
+#endif
+
+	if (!_ping_open(INADDR_ANY, opts, e->ident, &e->ctx)) {
+		e->ctx.fd = -1;
+		return false;
+	}
+	e->ident = e->ctx.ident;
+
+	/* A raw socket gets a copy of every ICMP packet on the host, let the kernel throw away what isn't ours.
+	 * Datagram sockets only ever see replies to their own ident */
+	if (e->ctx.raw && !icmp_attach_filter(e->ctx.fd, e->ident) && opts->log_type >= PING_LOG_FULL)
+		printf("Socket filter unavailable, filtering replies in user space\n");
+
+	int ttl = 64;
+	socklen_t ttl_len = sizeof(ttl);
+	getsockopt(e->ctx.fd, IPPROTO_IP, IP_TTL, &ttl, &ttl_len);
+	e->ttl = ttl;
+
+	/* Replies from all targets land in this one socket; give bursts some room */
+	int rcvbuf = 256 * 1024;
+	setsockopt(e->ctx.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (opts->timestamps != PING_TS_USER && !_engine_timestamps(e))
+		return false;
+
+#ifdef HAVE_TIMERFD
+	e->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+
+	/* The event loop never blocks in recv, poll() does the waiting */
+	int fl = fcntl(e->ctx.fd, F_GETFL, 0);
+	if (fl < 0 || fcntl(e->ctx.fd, F_SETFL, fl | O_NONBLOCK) < 0) {
+		perror("Failed to set O_NONBLOCK");
+		return false;
+	}
+	return true;
+}
+
+/* Set up the targets, template and receive buffers for one run */
+static bool _engine_prepare(struct ping_engine* e, const struct ping_opts* opts, const in_addr_t* addrs, int num_addrs,
+	struct ping_stats* stats) {
+	e->opts = opts;
+	e->num_targets = num_addrs;
+	e->outstanding = 0;
+	e->stop = false;
+	e->last_send = 0;
+	e->duration = 0;
+	lat_hist_init(&e->send_err);
+	e->rt_offset = (int64_t)time_realtime_ns() - (int64_t)time_now_ns();
+
+	/* Flooding sends whenever the window has room, one request per reply unless told otherwise */
+	e->interval = opts->flood ? 0 : opts->interval * 1e9;
+	e->timeout = opts->read_timeout * 1e9;
+	e->window = opts->window > 0 ? opts->window : opts->flood ? 1 : 0;
+
+	/* Enough slots to cover every request that may still be in flight when the next one goes out */
+	const double linger = opts->interval > opts->read_timeout ? opts->interval : opts->read_timeout;
+	uint32_t nslots = e->interval > 0 ? (uint32_t)CLAMP(linger * 1e9 / e->interval + 2, 0, PING_MAX_SLOTS) : 0;
+	nslots = (uint32_t)e->window * 2 > nslots ? (uint32_t)e->window * 2 : nslots;
+	nslots = CLAMP(_pow2_ceil(nslots), PING_MIN_SLOTS, PING_MAX_SLOTS);
+
+	e->table_mask = _pow2_ceil(num_addrs * 2) - 1;
+	e->table = malloc(sizeof(int) * (e->table_mask + 1));
+	e->targets = calloc(num_addrs, sizeof(struct ping_target));
+
+	/* Only grow the receive buffers, a session that alternates sizes shouldn't keep reallocating */
+	const size_t rx_size = sizeof(struct ip) + 60 /* IP options */ + sizeof(struct ping_packet) + opts->payload_size;
+	if (rx_size > e->rx_size) {
+		free(e->rx);
+		e->rx_size = rx_size;
+		e->rx_batch = CLAMP(PING_BATCH_BYTES / rx_size, 1, PING_BATCH);
+		e->rx = malloc(e->rx_size * e->rx_batch);
+		for (int i = 0; e->rx && i < e->rx_batch; ++i) {
+			e->rx_iov[i].iov_base = e->rx + i * e->rx_size;
+			e->rx_iov[i].iov_len = e->rx_size;
+		}
+	}
+
+	if (!_ping_template_init(&e->tpl, opts, e->ident) || !e->table || !e->targets || !e->rx) {
+		printf("Out of memory\n");
+		return false;
+	}
+	memset(e->table, -1, sizeof(int) * (e->table_mask + 1));
+
+	/* Each request is its own header followed by the template payload, or its own for per packet patterns */
+	if (pattern_per_packet(opts->pattern_mode)) {
+		e->tx_payload = malloc(e->tx_batch * e->tpl.payload_size + 1);
+		if (!e->tx_payload) {
+			printf("Out of memory\n");
+			return false;
+		}
+	}
+	for (int i = 0; i < e->tx_batch; ++i) {
+		e->tx_iov[i * 2 + 1].iov_base = e->tx_payload ? e->tx_payload + i * e->tpl.payload_size : e->tpl.payload;
+		e->tx_iov[i * 2 + 1].iov_len = e->tpl.payload_size;
+	}
+
+	/* Send timestamps still queued from the last run point at targets that are gone */
+	if (e->tx_keys) {
+		for (int i = 0; i < PING_TXKEY_RING; ++i)
+			e->tx_keys[i].target = -1;
+	}
+
+	for (int i = 0; i < num_addrs; ++i) {
+		struct ping_target* t = &e->targets[i];
+		if (_engine_lookup(e, addrs[i])) {
+			struct in_addr a = {addrs[i]};
+			printf("Duplicate target %s\n", inet_ntoa(a));
+			return false;
+		}
+
+		t->addr.sin_family = AF_INET;
+		t->addr.sin_addr.s_addr = addrs[i];
+		t->stats = &stats[i];
+		t->src = opts->capture ? capture_local_addr(addrs[i]) : INADDR_ANY;
+		t->lastseq = (int)e->seq_base - 1;
+		t->slot_mask = nslots - 1;
+		t->slots = calloc(nslots, sizeof(struct ping_slot));
+		if (!t->slots) {
+			printf("Out of memory\n");
+			return false;
+		}
+		inet_ntop(AF_INET, &t->addr.sin_addr, t->name, sizeof(t->name));
+
+		memset(t->stats, 0, sizeof(*t->stats));
+		lat_hist_init(&t->stats->hist);
+
+		uint32_t h = _addr_hash(addrs[i]) & e->table_mask;
+		while (e->table[h] >= 0)
+			h = (h + 1) & e->table_mask;
+		e->table[h] = i;
+	}
+	return true;
+}
+
+/* Every request the kernel accepted bumps its timestamp id, remember which one it was */
+static void _engine_txkey(struct ping_engine* e, int queued) {
+	if (!e->tx_timestamps)
+		return;
+	e->tx_keys[e->tx_key++ % PING_TXKEY_RING] = e->tx_queued[queued];
+}
+
+/* Request i of the batch made it to the kernel */
+static void _engine_sent(struct ping_engine* e, int i) {
+	_engine_txkey(e, i);
+	if (e->opts->capture) {
+		const struct ping_target* t = &e->targets[e->tx_queued[i].target];
+		const struct iovec* iov = &e->tx_iov[i * 2];
+		capture_icmp(e->opts->capture, time_realtime_ns(), t->src, t->addr.sin_addr.s_addr, e->ttl, iov[0].iov_base, iov[0].iov_len,
+			iov[1].iov_base, iov[1].iov_len);
+	}
+}
+
+/* Push out every queued echo request, as few syscalls as the platform allows */
+static void _engine_flush(struct ping_engine* e) {
+	const bool quiet = e->opts->log_type < PING_LOG_FULL;
+	int done = 0;
+
+#ifdef HAVE_MMSG
+	while (e->use_mmsg && done < e->tx_count) {
+		int r = sendmmsg(e->ctx.fd, e->tx_msgs + done, e->tx_count - done, 0);
+		if (r >= 0) {
+			for (int i = done; i < done + r; ++i)
+				_engine_sent(e, i);
+			done += r;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == ENOSYS) {
+			e->use_mmsg = false;
+			break;
+		}
+		/* The first message in the batch failed, drop it and carry on with the rest */
+		if (!quiet)
+			perror("sendmmsg failed");
+		++done;
+	}
+#endif
+
+	for (; done < e->tx_count; ++done) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = (void*)e->tx_dst[done];
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+		msg.msg_iov = &e->tx_iov[done * 2];
+		msg.msg_iovlen = 2;
+		if (sendmsg(e->ctx.fd, &msg, 0) < 0) {
+			if (!quiet)
+				perror("sendmsg failed");
+		}
+		else
+			_engine_sent(e, done);
+	}
+	e->tx_count = 0;
+}
+
+/* Hand the outcome of a request to the recorder and on_record. now is 0 if it was lost */
+static void _engine_record(struct ping_engine* e, struct ping_target* t, const struct ping_slot* s, uint64_t now,
+	uint64_t rtt, ssize_t len, int flags, int ts) {
+	const struct ping_opts* opts = e->opts;
+	if (!opts->recorder && !opts->on_record)
+		return;
+
+	struct ping_record rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.sent_ns = s->sent + e->rt_offset;
+	rec.recv_ns = now ? now + e->rt_offset : 0;
+	rec.rtt_ns = rtt;
+	rec.target = t->addr.sin_addr.s_addr;
+	rec.seq = s->seq;
+	rec.size = len > 0xFFFF ? 0xFFFF : len;
+	rec.flags = flags;
+	rec.ts = ts;
+	if (opts->recorder)
+		ping_recorder_push(opts->recorder, &rec);
+	if (!opts->on_record)
+		return;
+	const int action = opts->on_record(opts->on_record_arg, &rec);
+	e->stop |= action == PING_RECORD_STOP;
+	t->stopped |= action == PING_RECORD_STOP_TARGET;
+}
+
+/* Record every request of the run that never got an answer */
+static void _engine_record_lost(struct ping_engine* e) {
+	if (!e->opts->recorder && !e->opts->on_record)
+		return;
+	for (int i = 0; i < e->num_targets; ++i) {
+		struct ping_target* t = &e->targets[i];
+		const uint64_t first = t->seq > t->slot_mask + 1 ? t->seq - (t->slot_mask + 1) : 0;
+		for (uint64_t n = first; n < t->seq; ++n) {
+			const uint16_t seq = _engine_seq(e, n);
+			const struct ping_slot* s = &t->slots[seq & t->slot_mask];
+			if (s->seq == seq && (s->state == PING_SLOT_PENDING || s->state == PING_SLOT_EXPIRED))
+				_engine_record(e, t, s, 0, 0, 0, PING_REC_LOST, PING_TS_USER);
+		}
+	}
+}
+
+/* Build the next echo request for t and queue it, it goes out with the next flush */
+static void _engine_send(struct ping_engine* e, struct ping_target* t) {
+	const uint16_t seq = _engine_seq(e, t->seq);
+	struct ping_slot* s = &t->slots[seq & t->slot_mask];
+
+	/* Reusing a slot whose request never got a reply, it's lost for good now */
+	if (s->state == PING_SLOT_PENDING)
+		--t->inflight;
+	if (s->state == PING_SLOT_LOST)
+		--e->outstanding; /* Recorded when it expired */
+	if (s->state == PING_SLOT_PENDING || s->state == PING_SLOT_EXPIRED) {
+		--e->outstanding;
+		_engine_record(e, t, s, 0, 0, 0, PING_REC_LOST, PING_TS_USER);
+	}
+
+	if (e->tx_count >= e->tx_batch)
+		_engine_flush(e);
+
+	const int i = e->tx_count++;
+	_ping_template_fill(&e->tpl, &e->tx[i], seq);
+	if (e->tx_payload)
+		_ping_template_fill_payload(&e->tpl, &e->tx[i], seq, e->tx_payload + i * e->tpl.payload_size);
+	e->tx_dst[i] = &t->addr;
+	e->tx_queued[i].target = t - e->targets;
+	e->tx_queued[i].seq = seq;
+#ifdef HAVE_MMSG
+	e->tx_msgs[i].msg_hdr.msg_name = &t->addr;
+	e->tx_msgs[i].msg_hdr.msg_namelen = sizeof(t->addr);
+#endif
+
+	s->seq = seq;
+	s->state = PING_SLOT_PENDING;
+	s->sent = time_now_ns();
+	s->sent_rt = e->timestamps != PING_TS_USER ? time_realtime_ns() : 0;
+	s->tx_sw = s->tx_hw = 0;
+
+	++e->outstanding;
+	++t->inflight;
+	++t->seq;
+	++t->stats->sent;
+	t->stats->lost = t->stats->sent - t->received;
+	e->last_send = s->sent;
+}
+
+static const char* const s_ts_names[PING_TS_NUM] = {"user", "sw", "hw"};
+
+/* Everything that arrives on the socket goes to the capture, before any filtering */
+static void _engine_capture_rx(struct ping_engine* e, const struct sockaddr_in* from, const char* data, ssize_t len,
+	uint64_t now, const struct ping_rxts* rxts) {
+	struct capture* c = e->opts->capture;
+	const uint64_t ts = rxts->sw ? rxts->sw : now + e->rt_offset;
+	if (e->ctx.raw) {
+		capture_ip(c, ts, data, len);
+		return;
+	}
+	/* Datagram sockets strip the IP header, the TTL it had is gone */
+	const struct ping_target* t = _engine_lookup(e, from->sin_addr.s_addr);
+	capture_icmp(c, ts, from->sin_addr.s_addr, t ? t->src : INADDR_ANY, 0, data, len, NULL, 0);
+}
+
+static void _engine_handle(struct ping_engine* e, const struct sockaddr_in* from, char* data, ssize_t len, uint64_t now,
+	const struct ping_rxts* rxts) {
+	const struct ping_opts* opts = e->opts;
+	const bool quiet = opts->log_type < PING_LOG_FULL;
+	const bool silent = opts->log_type < PING_LOG_MINIMAL;
+
+	if (opts->capture)
+		_engine_capture_rx(e, from, data, len, now, rxts);
+
+	/* Raw sockets give us the full IP frame, skip past the header */
+	if (e->ctx.raw) {
+		const struct ip* ipf = (const struct ip*)data;
+		if (len < (ssize_t)sizeof(struct ip) || len < ipf->ip_hl * 4)
+			return;
+		data += ipf->ip_hl * 4;
+		len -= ipf->ip_hl * 4;
+	}
+
+	struct ping_packet* rmsg = (struct ping_packet*)data;
+	if (len < ICMP_MINLEN)
+		return;
+
+	/* Filter out any non-echo replies, or replies to somebody else's requests. The socket filter
+	 * normally did this already, but it may not be available */
+	if (rmsg->icmp.icmp_type != ICMP_ECHOREPLY || rmsg->icmp.icmp_hun.ih_idseq.icd_id != e->ident)
+		return;
+
+	struct ping_target* t = _engine_lookup(e, from->sin_addr.s_addr);
+	if (!t)
+		return;
+
+	const uint16_t seq = rmsg->icmp.icmp_hun.ih_idseq.icd_seq;
+	struct ping_slot* s = &t->slots[seq & t->slot_mask];
+	if (s->state == PING_SLOT_FREE || s->seq != seq)
+		return; /* Never sent, or so old its slot has been recycled */
+
+	// Certain servers may be configured to truncate ICMP requests above a certain size (i.e. google.com)
+	const int trunc = len < (ssize_t)(sizeof(struct ping_packet) + opts->payload_size);
+
+	/* Use the most precise pair of timestamps we have, never mixing clocks */
+	int rxsrc = PING_TS_USER, txsrc = PING_TS_USER;
+	uint64_t rtt = now - s->sent;
+	if (rxts->hw && s->tx_hw) {
+		rtt = rxts->hw - s->tx_hw;
+		rxsrc = txsrc = PING_TS_HARDWARE;
+	}
+	else if (rxts->sw) {
+		const uint64_t tx = s->tx_sw ? s->tx_sw : s->sent_rt;
+		rtt = rxts->sw > tx ? rxts->sw - tx : 0;
+		rxsrc = PING_TS_SOFTWARE;
+		txsrc = s->tx_sw ? PING_TS_SOFTWARE : PING_TS_USER;
+	}
+	const float diffms = rtt / 1e6;
+
+	const int ooo = t->lastseq != (int)seq - 1;
+	const int recflags = (trunc ? PING_REC_TRUNC : 0) | (ooo ? PING_REC_OUT_OF_ORDER : 0) |
+		(s->state == PING_SLOT_EXPIRED || s->state == PING_SLOT_LOST ? PING_REC_LATE : 0);
+
+	if (s->state == PING_SLOT_DONE) {
+		_engine_record(e, t, s, now, rtt, len, recflags | PING_REC_DUP, rxsrc);
+		if (!quiet)
+			printf("%ld bytes from %s: icmp_seq=%d time=%.2f ms (DUP)\n", (long)len, t->name, seq, diffms);
+		return;
+	}
+
+	if (s->state == PING_SLOT_PENDING)
+		--t->inflight;
+	s->state = PING_SLOT_DONE;
+	--e->outstanding;
+
+	// Validate ICMP packet
+	struct ping_corruption corrupt;
+	if (!_icmp_validate(_ping_template_expected(&e->tpl, seq), e->tpl.payload_size, rmsg, len, &corrupt)) {
+		if (!silent)
+			_ping_corruption_print(t->name, seq, &corrupt);
+		_ping_corruption_add(t->stats, &corrupt);
+		_engine_record(e, t, s, now, rtt, len, recflags | PING_REC_CORRUPT, rxsrc);
+		return;
+	}
+	_engine_record(e, t, s, now, rtt, len, recflags, rxsrc);
+
+	struct ping_stats* st = t->stats;
+	++st->ts_rx[rxsrc];
+	++st->ts_tx[txsrc];
+	lat_hist_record(&st->hist, rtt);
+	++t->received;
+	st->lost = st->sent - t->received;
+
+	if (!quiet && e->timestamps != PING_TS_USER)
+		printf("%ld bytes from %s: icmp_seq=%d time=%.3f ms ts=%s/%s %s%s\n", (long)len, t->name, seq, diffms,
+			s_ts_names[txsrc], s_ts_names[rxsrc], ooo ? "(OUT OF ORDER)" : "", trunc ? "(TRUNC)" : "");
+	else if (!quiet)
+		printf("%ld bytes from %s: icmp_seq=%d time=%.2f ms %s%s\n", (long)len, t->name, seq, diffms,
+			ooo ? "(OUT OF ORDER)" : "", trunc ? "(TRUNC)" : "");
+	t->lastseq = seq;
+}
+
+/* Stop counting requests older than the read timeout against the window */
+static void _engine_expire(struct ping_engine* e, struct ping_target* t, uint64_t now) {
+	for (; t->tail < t->seq; ++t->tail) {
+		const uint16_t seq = _engine_seq(e, t->tail);
+		struct ping_slot* s = &t->slots[seq & t->slot_mask];
+		if (s->seq != seq || s->state != PING_SLOT_PENDING)
+			continue;
+		if (now - s->sent < e->timeout)
+			return;
+		--t->inflight;
+		s->state = PING_SLOT_EXPIRED;
+		if (e->opts->on_record) {
+			/* Nobody waits any longer than this, tell on_record now rather than when the slot comes around again */
+			_engine_record(e, t, s, 0, 0, 0, PING_REC_LOST, PING_TS_USER);
+			s->state = PING_SLOT_LOST;
+		}
+	}
+}
+
+/* Collect kernel send timestamps from the error queue and attach them to their requests */
+static void _engine_drain_errqueue(struct ping_engine* e) {
+#ifdef HAVE_TX_TIMESTAMPS
+	for (;;) {
+		char ctrl[PING_CMSG_SIZE];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		if (recvmsg(e->ctx.fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		struct ping_rxts ts = {0, 0};
+		const struct sock_extended_err* err = NULL;
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPING) {
+				struct timespec tss[3];
+				memcpy(tss, CMSG_DATA(c), sizeof(tss));
+				ts.sw = timespec_to_ns(&tss[0]);
+				ts.hw = timespec_to_ns(&tss[2]);
+			}
+			else if (c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR)
+				err = (const struct sock_extended_err*)CMSG_DATA(c);
+		}
+		if (!err || err->ee_errno != ENOMSG || err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+			continue;
+
+		/* Too old, the key ring has wrapped since */
+		if (e->tx_key - err->ee_data > PING_TXKEY_RING)
+			continue;
+		const struct ping_txkey* k = &e->tx_keys[err->ee_data % PING_TXKEY_RING];
+		if (k->target < 0 || k->target >= e->num_targets)
+			continue;
+		struct ping_target* t = &e->targets[k->target];
+		struct ping_slot* s = &t->slots[k->seq & t->slot_mask];
+		if (s->seq != k->seq || s->state == PING_SLOT_FREE)
+			continue;
+
+		/* Guard against the key mapping drifting, a send can't be stamped before we made the call */
+		if (ts.sw && ts.sw + 1000000 >= s->sent_rt)
+			s->tx_sw = ts.sw;
+		if (ts.hw)
+			s->tx_hw = ts.hw;
+	}
+#else
+	(void)e;
+#endif
+}
+
+static void _engine_drain(struct ping_engine* e) {
+	const bool quiet = e->opts->log_type < PING_LOG_FULL;
+
+	/* Send timestamps are already queued by the time the reply can arrive, grab them first */
+	if (e->tx_timestamps)
+		_engine_drain_errqueue(e);
+
+#ifdef HAVE_MMSG
+	while (e->use_mmsg) {
+		for (int i = 0; i < e->rx_batch; ++i) {
+			e->rx_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			e->rx_msgs[i].msg_hdr.msg_controllen = PING_CMSG_SIZE;
+		}
+
+		int r = recvmmsg(e->ctx.fd, e->rx_msgs, e->rx_batch, MSG_DONTWAIT, NULL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOSYS) {
+				e->use_mmsg = false;
+				break;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK && !quiet)
+				perror("recvmmsg failed");
+			return;
+		}
+
+		const uint64_t now = time_now_ns();
+		for (int i = 0; i < r; ++i) {
+			struct ping_rxts ts;
+			_parse_rxts(&e->rx_msgs[i].msg_hdr, &ts);
+			_engine_handle(e, &e->rx_from[i], e->rx_iov[i].iov_base, e->rx_msgs[i].msg_len, now, &ts);
+		}
+
+		/* Came up short, the socket is empty */
+		if (r < e->rx_batch)
+			return;
+	}
+#endif
+
+	for (;;) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &e->rx_from[0];
+		msg.msg_namelen = sizeof(struct sockaddr_in);
+		msg.msg_iov = &e->rx_iov[0];
+		msg.msg_iovlen = 1;
+		msg.msg_control = e->rx_cmsg;
+		msg.msg_controllen = PING_CMSG_SIZE;
+
+		ssize_t ret = recvmsg(e->ctx.fd, &msg, MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK && !quiet)
+				perror("recvmsg failed");
+			return;
+		}
+
+		struct ping_rxts ts;
+		_parse_rxts(&msg, &ts);
+		_engine_handle(e, &e->rx_from[0], e->rx, ret, time_now_ns(), &ts);
+	}
+}
+
+/* Sleep until the socket has something for us or the absolute deadline (monotonic ns) passes. pfd[0] is the socket */
+static int _engine_wait(struct ping_engine* e, uint64_t deadline, struct pollfd* pfd) {
+	pfd[0].fd = e->ctx.fd;
+	pfd[0].events = POLLIN;
+	pfd[0].revents = 0;
+
+	const uint64_t now = time_now_ns();
+	if (deadline <= now)
+		return poll(pfd, 1, 0);
+
+	struct timespec abs;
+	abs.tv_sec = deadline / 1000000000ULL;
+	abs.tv_nsec = deadline % 1000000000ULL;
+
+#ifdef HAVE_TIMERFD
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value = abs;
+	if (e->timer_fd >= 0 && timerfd_settime(e->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+		pfd[1].fd = e->timer_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		int r = poll(pfd, 2, -1);
+		if (r > 0 && (pfd[1].revents & POLLIN)) {
+			uint64_t expirations;
+			ssize_t n = read(e->timer_fd, &expirations, sizeof(expirations));
+			(void)n;
+		}
+		return r;
+	}
+#endif
+
+#ifdef TIMER_ABSTIME
+	/* poll() counts in ms: wait out the whole ms, then sleep the rest off against the absolute deadline */
+	int r = poll(pfd, 1, (int)((deadline - now) / 1000000));
+	if (r == 0) {
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &abs, NULL) == EINTR)
+			;
+	}
+	return r;
+#else
+	(void)abs;
+	return poll(pfd, 1, (int)((deadline - now + 999999) / 1000000));
+#endif
+}
+
+static void _engine_run(struct ping_engine* e) {
+	const struct ping_opts* opts = e->opts;
+	const bool progress = opts->log_type == PING_LOG_MINIMAL && opts->progress > 0;
+	const uint64_t linger = e->interval > e->timeout ? e->interval : e->timeout;
+
+	/* Spread the targets evenly over one interval so sends go out at a steady rate */
+	const uint64_t start = time_now_ns();
+	for (int i = 0; i < e->num_targets; ++i)
+		e->targets[i].next_send = start + (e->interval / e->num_targets) * i;
+
+	for (;;) {
+		uint64_t now = time_now_ns();
+		uint64_t deadline = UINT64_MAX;
+		bool sending = false;
+
+		for (int i = 0; i < e->num_targets; ++i) {
+			struct ping_target* t = &e->targets[i];
+			if (e->window || opts->on_record)
+				_engine_expire(e, t, now);
+
+			/* Sends follow an absolute schedule, a full window only holds them back until a reply or timeout frees a slot.
+			 * A batch at most per pass, a zero interval is always due and would never get back to reading replies */
+			for (int burst = 0; burst < PING_BATCH && !e->stop && !t->stopped && t->seq < (uint64_t)opts->num_packets &&
+				t->next_send <= now && (!e->window || t->inflight < e->window); ++burst) {
+				const uint64_t due = t->next_send;
+				_engine_send(e, t);
+				t->next_send += e->interval;
+				if (e->interval)
+					lat_hist_record(&e->send_err, e->last_send - due);
+
+				// Display progress every so often
+				if (progress && (t->seq - 1) % opts->progress == 0) {
+					struct ping_stats* st = t->stats;
+					ping_stats_update(st);
+					printf("%s: %llu sent so far, %d in-flight (or lost), %d corrupted, icmp_seq=%d\n", t->name,
+						(unsigned long long)t->seq, st->lost, st->corrupted, _engine_seq(e, t->seq - 1));
+					printf("  min=%.2f ms, max=%.2f ms, avg=%.2f ms\n", st->minTime, st->maxTime, st->avgTime);
+				}
+			}
+
+			if (e->stop || t->stopped || t->seq >= (uint64_t)opts->num_packets)
+				continue;
+			sending = true;
+
+			uint64_t next = t->next_send;
+			if (e->window && t->inflight >= e->window) {
+				/* Window is full, the oldest request timing out is the next thing that can free it */
+				const struct ping_slot* s = &t->slots[_engine_seq(e, t->tail) & t->slot_mask];
+				next = s->sent + e->timeout;
+				next = next < t->next_send ? t->next_send : next;
+			}
+			deadline = next < deadline ? next : deadline;
+		}
+
+		/* Everything due this round goes out in one batch */
+		if (e->tx_count)
+			_engine_flush(e);
+
+		/* Everything is sent, wait around for stragglers */
+		if (!sending) {
+			if (e->outstanding <= 0 || now >= e->last_send + linger)
+				break;
+			deadline = e->last_send + linger;
+		}
+
+		struct pollfd pfd[2];
+		int r = _engine_wait(e, deadline, pfd);
+		if (r < 0 && errno != EINTR) {
+			perror("poll failed");
+			break;
+		}
+		if (r > 0 && (pfd[0].revents & POLLIN))
+			_engine_drain(e);
+		else if (r > 0 && (pfd[0].revents & POLLERR))
+			_engine_drain_errqueue(e);
+	}
+
+	e->duration = time_now_ns() - start;
+}
+
+struct ping_session* ping_session_open(const struct ping_opts* opts) {
+	struct ping_session* s = malloc(sizeof(struct ping_session));
+	if (!s) {
+		printf("Out of memory\n");
+		return NULL;
+	}
+	if (!_engine_open(&s->engine, opts)) {
+		_engine_free(&s->engine);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+void ping_session_close(struct ping_session* s) {
+	if (!s)
+		return;
+	_engine_free(&s->engine);
+	free(s);
+}
+
+bool ping_session_run(struct ping_session* s, const struct ping_opts* opts, const in_addr_t* addrs, int num_addrs,
+	struct ping_stats* stats) {
+	if (num_addrs <= 0)
+		return false;
+
+	struct ping_engine* e = &s->engine;
+	if (!_engine_prepare(e, opts, addrs, num_addrs, stats)) {
+		_engine_release(e);
+		return false;
+	}
+
+	_engine_run(e);
+	_engine_record_lost(e);
+
+	bool ok = true;
+	for (int i = 0; i < num_addrs; ++i) {
+		struct ping_target* t = &e->targets[i];
+		struct ping_stats* st = t->stats;
+		ping_stats_update(st);
+
+		if (opts->log_type >= PING_LOG_MINIMAL) {
+			printf("%s: %d packets transmitted, %d received, %d corrupted, %.2f%% packet loss\n", t->name,
+				st->sent, t->received, st->corrupted, st->sent ? 100.f * st->lost / st->sent : 0.f);
+			printf("  min=%.2f ms, max=%.2f ms, avg=%.2f ms\n", st->minTime, st->maxTime, st->avgTime);
+			if (st->hist.count)
+				lat_hist_print(&st->hist, "  ");
+			if (e->timestamps != PING_TS_USER)
+				printf("  timestamps tx user/sw/hw=%d/%d/%d, rx user/sw/hw=%d/%d/%d\n", st->ts_tx[PING_TS_USER],
+					st->ts_tx[PING_TS_SOFTWARE], st->ts_tx[PING_TS_HARDWARE], st->ts_rx[PING_TS_USER],
+					st->ts_rx[PING_TS_SOFTWARE], st->ts_rx[PING_TS_HARDWARE]);
+			if (st->bad_bytes) {
+				const uint64_t* f = st->bit_flips;
+				printf("  %llu bad bytes (%llu multi-bit, longest burst %u), bits set/cleared=%llu/%llu, "
+					"flips b0-b7=%llu/%llu/%llu/%llu/%llu/%llu/%llu/%llu\n",
+					(unsigned long long)st->bad_bytes, (unsigned long long)st->multi_bit, st->longest_burst,
+					(unsigned long long)st->bits_set, (unsigned long long)st->bits_cleared, (unsigned long long)f[0],
+					(unsigned long long)f[1], (unsigned long long)f[2], (unsigned long long)f[3], (unsigned long long)f[4],
+					(unsigned long long)f[5], (unsigned long long)f[6], (unsigned long long)f[7]);
+			}
+			if (st->lost_bytes)
+				printf("  %llu payload bytes missing from truncated replies\n", (unsigned long long)st->lost_bytes);
+			if (opts->flood || opts->window > 0)
+				printf("  %.1f packets/s over %.3f s\n", e->duration ? st->sent / (e->duration / 1e9) : 0., e->duration / 1e9);
+		}
+		ok = ok && st->lost == 0 && st->corrupted == 0;
+	}
+
+	if (opts->log_type >= PING_LOG_MINIMAL && e->send_err.count) {
+		const struct lat_hist* h = &e->send_err;
+		printf("send schedule error: p50=%.1f us, p99=%.1f us, max=%.1f us over %llu sends\n", lat_hist_percentile(h, 50) / 1e3,
+			lat_hist_percentile(h, 99) / 1e3, h->max / 1e3, (unsigned long long)h->count);
+	}
+
+	_engine_release(e);
+	return ok;
+}
+
+bool icmp_ping_multi(const struct ping_opts* opts, const in_addr_t* addrs, int num_addrs, struct ping_stats* stats) {
+	if (num_addrs <= 0)
+		return false;
+
+	struct ping_session* s = ping_session_open(opts);
+	if (!s)
+		return false;
+	const bool ok = ping_session_run(s, opts, addrs, num_addrs, stats);
+	ping_session_close(s);
+	return ok;
+}
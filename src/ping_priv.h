@@ -0,0 +1,91 @@
+/**
+ * Internal definitions shared by the ping sources. Not installed.
+ */
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in_systm.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ping.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Why on earth is this missing from RTEMS??? Not in limits.h or stdint.h????
+#ifndef UINT64_MAX
+#	define UINT64_MAX 0xffffffffffffffffULL
+#endif
+
+// Not available on RTEMS, but that's okay...
+#ifndef MSG_DONTWAIT
+#	define MSG_DONTWAIT 0
+#endif
+
+/* No ICMP datagram sockets on RTEMS */
+#if defined(__rtems__)
+#	define PING_RAW_ONLY 1
+#endif
+
+struct ping_ctx {
+	int fd;
+	struct sockaddr_in addr;
+	bool raw;	/* Raw socket, received packets start with the IP header */
+	uint16_t ident;	/* Echo ident the socket actually uses, datagram sockets may not get the one asked for */
+};
+
+struct __attribute__((packed)) ping_packet {
+    struct icmp icmp;
+    uint32_t sec;
+    uint32_t nsec;
+    char payload[];
+};
+
+/**
+ * Echo request built once per run. Only the seq and timestamp change between packets, so each request is a copy
+ * of the header with its checksum patched incrementally, followed by the shared payload.
+ */
+struct ping_template {
+	struct ping_packet hdr;	/* seq, sec and nsec are 0, the checksum covers header and payload */
+	char* payload;
+	size_t payload_size;
+	uint16_t payload_sum;	/* One's complement sum of payload */
+	int mode;		/* enum pattern_mode */
+	uint8_t seed;
+	char* scratch;		/* Expected payload of one reply, per packet patterns only */
+};
+
+/* Open an ICMP socket, datagram or raw as opts->sock_type asks. p->ident is the ident replies will carry */
+bool _ping_open(in_addr_t addr, const struct ping_opts* opts, uint16_t ident, struct ping_ctx* p);
+
+/* Check the checksum and compare the payload against what we sent. Fills in c, returns false if anything is off */
+bool _icmp_validate(const char* expected, size_t expected_size, struct ping_packet* packet, ssize_t recv_size,
+	struct ping_corruption* c);
+
+void _ping_corruption_print(const char* name, uint16_t seq, const struct ping_corruption* c);
+
+void _ping_corruption_add(struct ping_stats* stats, const struct ping_corruption* c);
+
+bool _ping_template_init(struct ping_template* tpl, const struct ping_opts* opts, uint16_t ident);
+
+void _ping_template_free(struct ping_template* tpl);
+
+/* Fill in the header of the next request. Cost doesn't depend on the payload size */
+void _ping_template_fill(const struct ping_template* tpl, struct ping_packet* hdr, uint16_t seq);
+
+/* Per packet patterns: generate the payload for seq and fix up the checksum _ping_template_fill left in hdr */
+void _ping_template_fill_payload(const struct ping_template* tpl, struct ping_packet* hdr, uint16_t seq, char* payload);
+
+/* The payload the reply to seq should carry. Valid until the next call */
+const char* _ping_template_expected(struct ping_template* tpl, uint16_t seq);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,145 @@
+/**
+ * ping_recorder.c -- Streams per-packet ping records to a file from a background thread
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ping.h"
+#include "spsc_ring.h"
+
+#define PING_RECORDER_RING (4 * 1024 * 1024)	/* ~100k records of slack if the disk stalls */
+#define PING_RECORDER_IOBUF (1024 * 1024)
+#define PING_RECORDER_IDLE_MS 10		/* Writer sleep when the ring is empty */
+
+static const char PING_RECORD_MAGIC[8] = {'P', 'I', 'N', 'G', 'R', 'E', 'C', '1'};
+
+struct ping_recorder {
+	struct spsc_ring ring;
+	FILE* fp;
+	char* iobuf;
+	int format;
+	int run;
+	pthread_t thread;
+	uint64_t written;
+};
+
+static void _recorder_write(struct ping_recorder* r, const struct ping_record* rec) {
+	if (r->format == PING_RECORD_BINARY) {
+		fwrite(rec, sizeof(*rec), 1, r->fp);
+		return;
+	}
+
+	char flags[48] = "";
+	size_t n = 0;
+	static const char* const names[] = {"lost", "dup", "ooo", "trunc", "corrupt", "late"};
+	for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); ++i) {
+		if (rec->flags & (1 << i))
+			n += snprintf(flags + n, sizeof(flags) - n, "%s%s", n ? "|" : "", names[i]);
+	}
+
+	struct in_addr a = {rec->target};
+	char addr[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &a, addr, sizeof(addr));
+	fprintf(r->fp, "%s,%u,%llu,%llu,%llu,%u,%s\n", addr, rec->seq, (unsigned long long)rec->sent_ns,
+		(unsigned long long)rec->recv_ns, (unsigned long long)rec->rtt_ns, rec->size, flags);
+}
+
+/* Write out everything in the ring, returns the number of records */
+static size_t _recorder_drain(struct ping_recorder* r) {
+	size_t count = 0, len;
+	const void* p;
+	while ((p = spsc_ring_front(&r->ring, &len))) {
+		_recorder_write(r, (const struct ping_record*)p);
+		spsc_ring_release(&r->ring, len);
+		++count;
+	}
+	r->written += count;
+	return count;
+}
+
+static void* _recorder_thread(void* arg) {
+	struct ping_recorder* r = (struct ping_recorder*)arg;
+	while (__atomic_load_n(&r->run, __ATOMIC_ACQUIRE)) {
+		if (_recorder_drain(r))
+			continue;
+		/* Idle, push what we have to disk so the file is never far behind */
+		fflush(r->fp);
+		struct timespec ts = {0, PING_RECORDER_IDLE_MS * 1000000L};
+		nanosleep(&ts, NULL);
+	}
+	_recorder_drain(r);
+	return NULL;
+}
+
+struct ping_recorder* ping_recorder_open(const char* path, int format) {
+	struct ping_recorder* r = calloc(1, sizeof(struct ping_recorder));
+	if (!r) {
+		printf("Out of memory\n");
+		return NULL;
+	}
+	r->format = format;
+	r->run = 1;
+
+	if (!spsc_ring_init(&r->ring, PING_RECORDER_RING) || !(r->iobuf = malloc(PING_RECORDER_IOBUF))) {
+		printf("Out of memory\n");
+		goto error;
+	}
+
+	if (!(r->fp = fopen(path, format == PING_RECORD_BINARY ? "wb" : "w"))) {
+		printf("Unable to open %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	setvbuf(r->fp, r->iobuf, _IOFBF, PING_RECORDER_IOBUF);
+
+	if (format == PING_RECORD_BINARY) {
+		const uint32_t size = sizeof(struct ping_record);
+		fwrite(PING_RECORD_MAGIC, sizeof(PING_RECORD_MAGIC), 1, r->fp);
+		fwrite(&size, sizeof(size), 1, r->fp);
+	}
+	else
+		fprintf(r->fp, "target,seq,sent_ns,recv_ns,rtt_ns,size,flags\n");
+
+	if (pthread_create(&r->thread, NULL, _recorder_thread, r) != 0) {
+		printf("Unable to start the record writer thread\n");
+		goto error;
+	}
+	return r;
+
+error:
+	if (r->fp)
+		fclose(r->fp);
+	spsc_ring_free(&r->ring);
+	free(r->iobuf);
+	free(r);
+	return NULL;
+}
+
+bool ping_recorder_push(struct ping_recorder* r, const struct ping_record* rec) {
+	void* p = spsc_ring_reserve(&r->ring, sizeof(*rec));
+	if (!p)
+		return false;
+	memcpy(p, rec, sizeof(*rec));
+	spsc_ring_commit(&r->ring);
+	return true;
+}
+
+uint64_t ping_recorder_dropped(const struct ping_recorder* r) {
+	return r->ring.dropped;
+}
+
+void ping_recorder_close(struct ping_recorder* r) {
+	if (!r)
+		return;
+	__atomic_store_n(&r->run, 0, __ATOMIC_RELEASE);
+	pthread_join(r->thread, NULL);
+	if (r->ring.dropped)
+		printf("Record writer fell behind, %llu records dropped\n", (unsigned long long)r->ring.dropped);
+	fclose(r->fp);
+	spsc_ring_free(&r->ring);
+	free(r->iobuf);
+	free(r);
+}
@@ -14,7 +14,9 @@
 #include <pthread.h>
 
 #include "ping.h"
+#include "pattern.h"
 #include "traceroute.h"
+#include "capture.h"
 #include "iputils.h"
 #include "getopt_s.h"
 
@@ -29,10 +31,13 @@ struct probe_opts_s {
     int tries;          /* How many samples? */
     int max_size;
     int sentry;
+    char record_path[256];  /* Log every request here if set */
+    char capture_path[256]; /* Capture every packet here if set */
+    struct capture_opts history; /* Sentry only keeps recent traffic and saves it when packets go missing */
 };
 
 struct probe_result_s {
-    struct ping_stats pstat;
+    struct ping_stats pstat;    /* All runs against this host */
     struct traceroute_result* tstat;
 };
 
@@ -60,7 +65,7 @@ int probe_cmd(int argc, char** argv) {
 
     int opt = 0;
     float time = 60 * 5; // Probe for 5 minutes by default
-    while ((opt = getopt_s(argc, argv, "t:hvc:m:s", &st)) != -1) {
+    while ((opt = getopt_s(argc, argv, "t:hvc:m:so:w:b:k:", &st)) != -1) {
         switch(opt) {
         case 't':
             time = atof(st.optarg);
@@ -82,14 +87,30 @@ int probe_cmd(int argc, char** argv) {
         case 'm':
             opts->max_size = atoi(st.optarg);
             break;
+        case 'o':
+            strncpy(opts->record_path, st.optarg, sizeof(opts->record_path) - 1);
+            break;
+        case 'w':
+            strncpy(opts->capture_path, st.optarg, sizeof(opts->capture_path) - 1);
+            break;
+        case 'b':
+            opts->history.history_bytes = (size_t)atoi(st.optarg) * 1024 * 1024;
+            break;
+        case 'k':
+            opts->history.history_ns = (uint64_t)(atof(st.optarg) * 1e9);
+            break;
         default:
             break;
         }
     }
 
     for (int i = st.optind; i < argc; ++i) {
-        if (opts->numaddrs < MAX_ADDRS)
-            opts->addrs[opts->numaddrs++] = inet_addr(argv[i]);
+        const in_addr_t addr = inet_addr(argv[i]);
+        int dup = 0;
+        for (int j = 0; j < opts->numaddrs; ++j)
+            dup |= opts->addrs[j] == addr;
+        if (!dup && opts->numaddrs < MAX_ADDRS)
+            opts->addrs[opts->numaddrs++] = addr;
     }
 
     if (opts->numaddrs <= 0) {
@@ -118,31 +139,61 @@ static void* _probe_sentry(void* p) {
     return NULL;
 }
 
-static void _probe_one(struct probe_opts_s* probe_opts, int cur_addr, struct probe_result_s* result) {
-    struct traceroute_opts opts;
-    traceroute_opts_init(&opts);
-    opts.ip.sin_addr.s_addr = probe_opts->addrs[cur_addr];
-    opts.ip.sin_family = AF_INET;
+void probe_opts_init(struct probe_opts_s* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->time = 60 * 5; /* 5 minutes by default */
+    opts->tries = 100;
+    opts->max_size = (1<<30);
+    capture_opts_init(&opts->history);
+}
+
+static void probe(struct probe_opts_s* opts) {
+    struct probe_result_s* results = calloc(opts->numaddrs, sizeof(struct probe_result_s));
+    struct ping_stats* pstats = calloc(opts->numaddrs, sizeof(struct ping_stats));
+    char (*strAddrs)[INET_ADDRSTRLEN] = calloc(opts->numaddrs, INET_ADDRSTRLEN);
+    if (!results || !pstats || !strAddrs) {
+        printf("Out of memory\n");
+        free(results);
+        free(pstats);
+        free(strAddrs);
+        return;
+    }
+    struct capture* capture = !opts->capture_path[0] ? NULL :
+        capture_open_opts(opts->capture_path, opts->sentry ? &opts->history : NULL);
 
-    memset(result, 0, sizeof(*result));
-    /* Grab a route */
-    traceroute(&opts, &result->tstat);
+    /* Grab a route to each host */
+    for (int i = 0; i < opts->numaddrs; ++i) {
+        lat_hist_init(&results[i].pstat.hist);
+
+        struct traceroute_opts tropts;
+        traceroute_opts_init(&tropts);
+        tropts.ip.sin_addr.s_addr = opts->addrs[i];
+        tropts.ip.sin_family = AF_INET;
+        tropts.capture = capture;
+        traceroute(&tropts, &results[i].tstat);
+
+        const struct in_addr a = { opts->addrs[i] };
+        inet_ntop(AF_INET, &a, strAddrs[i], INET_ADDRSTRLEN);
+    }
 
-    /* Ping with varying patterns and sizes */
+    /* Ping with varying patterns and sizes. All hosts are pinged at once, so a round takes as long as a single host would */
     struct ping_opts defpopts;
     icmp_ping_opts_init(&defpopts);
+    defpopts.num_packets = opts->sentry ? 10 : 100;
+    defpopts.interval = 0.25; /* ~4 packets a second */
+    defpopts.log_type = opts->verbose ? PING_LOG_FULL : opts->sentry ? PING_LOG_NONE : PING_LOG_MINIMAL;
+    defpopts.capture = capture;
 
-    char strAddr[128];
-    {
-        const struct in_addr a = { probe_opts->addrs[cur_addr] };
-        strncpy(strAddr, inet_ntoa(a), sizeof(strAddr));
-        strAddr[sizeof(strAddr)-1] = 0;
+    if (opts->record_path[0]) {
+        const size_t l = strlen(opts->record_path);
+        const int bin = l > 4 && !strcmp(opts->record_path + l - 4, ".bin");
+        defpopts.recorder = ping_recorder_open(opts->record_path, bin ? PING_RECORD_BINARY : PING_RECORD_CSV);
     }
 
-    defpopts.addr = probe_opts->addrs[cur_addr];
-    defpopts.num_packets = probe_opts->sentry ? 10 : 100;
-    defpopts.interval = 0.25; /* ~4 packets a second */
-    defpopts.log_type = probe_opts->verbose ? PING_LOG_FULL : probe_opts->sentry ? PING_LOG_NONE : PING_LOG_MINIMAL;
+    /* One socket for the whole probe, every round reuses it */
+    struct ping_session* session = ping_session_open(&defpopts);
+    if (!session)
+        goto done;
 
     struct timespec start = time_now();
 
@@ -153,61 +204,73 @@ static void _probe_one(struct probe_opts_s* probe_opts, int cur_addr, struct pro
 
     while (1)
     {
-        for (int i = 0; i < probe_opts->tries; ++i) {
+        for (int i = 0; i < opts->tries; ++i) {
 			if (!s_threadRun)
-				return;
+				goto done;
 
-            const uint32_t size = CLAMP(sizes[i % NUM_SAMPLES], 1, probe_opts->max_size);
+            const uint32_t size = CLAMP(sizes[i % NUM_SAMPLES], 1, opts->max_size);
             struct ping_opts popts = defpopts;
             popts.pattern = patterns[rand() % NUM_SAMPLES];
-            popts.payload_size = probe_opts->sentry ? 80 : size;
-			popts.interval = probe_opts->sentry ? 0.5 : intervals[rand() % NUM_SAMPLES];
-
-            if (!probe_opts->sentry)
-                printf("------------------------\nPinging %s, size %u, pattern 0x%X, interval %f\n", strAddr, size, (int)popts.pattern, popts.interval);
-
-            struct ping_stats pstat;
-            if (!icmp_ping(&popts, &pstat) && !pstat.sent) {
-                printf("  Failed.\n");
-                continue;
-            }
-
-            /* TODO: Merge this pstat with the result */
-            if (!probe_opts->sentry)
-                printf("  Completed (pattern 0x%X, size %u): %d sent, %d lost, %d corrupted, maxTime %f, minTime %f, avgTime %f\n",
-                    (int)popts.pattern, size, pstat.sent, pstat.lost, pstat.corrupted, pstat.maxTime, pstat.minTime, pstat.avgTime);
-            else if (pstat.lost) {
-                char b[128];
-                printf("[%s] lost %d packets to %s\n", time_now_str(b, sizeof(b)), pstat.lost, strAddr);
+            popts.pattern_mode = i % PATTERN_NUM; /* Fill bytes, counters and PRBS all stress links differently */
+            popts.payload_size = opts->sentry ? 80 : size;
+			popts.interval = opts->sentry ? 0.5 : intervals[rand() % NUM_SAMPLES];
+
+            if (!opts->sentry)
+                printf("------------------------\nPinging %d hosts, size %u, pattern %s 0x%X, interval %f\n", opts->numaddrs, size,
+                    pattern_name(popts.pattern_mode), (int)popts.pattern, popts.interval);
+
+            /* False also means loss, so go by what each host sent. A run that fails setting up leaves them all at 0 */
+            memset(pstats, 0, opts->numaddrs * sizeof(struct ping_stats));
+            ping_session_run(session, &popts, opts->addrs, opts->numaddrs, pstats);
+
+            for (int j = 0; j < opts->numaddrs; ++j) {
+                const struct ping_stats* pstat = &pstats[j];
+                if (!pstat->sent) {
+                    printf("  %s failed.\n", strAddrs[j]);
+                    continue;
+                }
+                ping_stats_merge(&results[j].pstat, pstat);
+                if (!opts->sentry)
+                    printf("  %s completed (pattern %s 0x%X, size %u): %d sent, %d lost, %d corrupted, maxTime %f, minTime %f, avgTime %f\n",
+                        strAddrs[j], pattern_name(popts.pattern_mode), (int)popts.pattern, size, pstat->sent, pstat->lost, pstat->corrupted, pstat->maxTime, pstat->minTime, pstat->avgTime);
+                else if (pstat->lost) {
+                    char b[128];
+                    printf("[%s] lost %d packets to %s\n", time_now_str(b, sizeof(b)), pstat->lost, strAddrs[j]);
+                    snprintf(b, sizeof(b), "lost %d packets to %s", pstat->lost, strAddrs[j]);
+                    capture_snapshot(capture, b);
+                }
             }
         }
 
         struct timespec now = time_now();
-        if (!probe_opts->sentry && time_diff(&now, &start) >= probe_opts->time)
+        if (!opts->sentry && time_diff(&now, &start) >= opts->time)
             break;
     }
-}
 
-void probe_opts_init(struct probe_opts_s* opts) {
-    memset(opts, 0, sizeof(*opts));
-    opts->time = 60 * 5; /* 5 minutes by default */
-    opts->tries = 100;
-    opts->max_size = (1<<30);
-}
-
-static void probe(struct probe_opts_s* opts) {
+done:
+    ping_session_close(session);
+    ping_recorder_close(defpopts.recorder);
+    capture_close(capture);
+    if (!opts->sentry)
+        printf("========================\n");
     for (int i = 0; i < opts->numaddrs; ++i) {
-        struct probe_result_s res;
-        _probe_one(opts, i, &res);
-	#ifdef EPICS
-		if (!s_threadRun)
-			return;
-	#endif
+        const struct ping_stats* total = &results[i].pstat;
+        if (!opts->sentry) {
+            printf("%s: %d sent, %d lost, %d corrupted, min=%.3f ms, max=%.3f ms, avg=%.3f ms\n", strAddrs[i],
+                total->sent, total->lost, total->corrupted, total->minTime, total->maxTime, total->avgTime);
+            if (total->hist.count)
+                lat_hist_print(&total->hist, "  ");
+        }
+        traceroute_result_free(results[i].tstat);
     }
+    free(results);
+    free(pstats);
+    free(strAddrs);
 }
 
 static void show_help() {
-    printf("probe [-t time] [-m max_size] [-c count] [-v] ADDRS...\n");
+    printf("probe [-t time] [-m max_size] [-c count] [-s] [-o records.csv|records.bin] [-w file.pcap] [-b MB] [-k seconds] [-v] ADDRS...\n");
+    printf("  With -s, -w only keeps the last -b MB (16) or -k seconds (60) of traffic and saves it to file-NNN.pcap when packets are lost\n");
 }
 
 #ifdef EPICS
@@ -0,0 +1,145 @@
+/**
+ * Lock-free single producer, single consumer ring of variable length records
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The producer reserves space, writes its record in place and commits it. The consumer looks at the front record
+ * and releases it once done. Neither side ever blocks or makes a syscall, a full ring makes the producer drop records.
+ * Records are 8 byte aligned and never wrap around the end of the buffer.
+ */
+struct spsc_ring {
+	char* buf;
+	uint64_t mask;
+
+	/* Producer side */
+	uint64_t head __attribute__((aligned(64)));	/* Published, everything before it is readable */
+	uint64_t cached_tail;	/* Producer's last look at tail */
+	uint64_t pending;	/* head after the reserved record is committed */
+	uint64_t dropped;	/* Records that didn't fit */
+
+	/* Consumer side, on its own cache line so the two don't bounce it around */
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t cached_head;
+};
+
+#define SPSC_RING_HDR 8
+#define SPSC_RING_PAD 0xFFFFFFFFu	/* Length of the filler at the end of the buffer when a record had to wrap */
+
+static inline size_t _spsc_ring_align(size_t len) {
+	return (len + 7) & ~(size_t)7;
+}
+
+/**
+ * \brief Set up a ring of at least size bytes (rounded up to a power of two). Returns false if out of memory
+ */
+static inline bool spsc_ring_init(struct spsc_ring* r, size_t size) {
+	size_t cap = 64;
+	while (cap < size)
+		cap <<= 1;
+	r->buf = (char*)malloc(cap);
+	r->mask = cap - 1;
+	r->head = r->cached_tail = r->pending = r->dropped = 0;
+	r->tail = r->cached_head = 0;
+	return r->buf != NULL;
+}
+
+static inline void spsc_ring_free(struct spsc_ring* r) {
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/**
+ * \brief Producer: space for a record of len bytes, or NULL if the ring is full. Nothing is visible until spsc_ring_commit
+ */
+static inline void* spsc_ring_reserve(struct spsc_ring* r, size_t len) {
+	const uint64_t cap = r->mask + 1;
+	const uint64_t need = SPSC_RING_HDR + _spsc_ring_align(len);
+	const uint64_t off = r->head & r->mask;
+	const uint64_t skip = cap - off < need ? cap - off : 0;	/* Filler to get back to the start of the buffer */
+
+	if (need > cap / 2)
+		return NULL;
+	if (cap - (r->head - r->cached_tail) < skip + need) {
+		r->cached_tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (cap - (r->head - r->cached_tail) < skip + need) {
+			++r->dropped;
+			return NULL;
+		}
+	}
+
+	if (skip)
+		*(uint32_t*)(r->buf + off) = SPSC_RING_PAD;
+	char* rec = r->buf + ((r->head + skip) & r->mask);
+	*(uint32_t*)rec = (uint32_t)len;
+	r->pending = r->head + skip + need;
+	return rec + SPSC_RING_HDR;
+}
+
+/**
+ * \brief Producer: publish the record from the last spsc_ring_reserve
+ */
+static inline void spsc_ring_commit(struct spsc_ring* r) {
+	__atomic_store_n(&r->head, r->pending, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Consumer: the oldest record and its length, or NULL if the ring is empty
+ */
+static inline const void* spsc_ring_front(struct spsc_ring* r, size_t* len) {
+	for (;;) {
+		if (r->tail == r->cached_head) {
+			r->cached_head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			if (r->tail == r->cached_head)
+				return NULL;
+		}
+
+		const uint64_t off = r->tail & r->mask;
+		const uint32_t l = *(const uint32_t*)(r->buf + off);
+		if (l == SPSC_RING_PAD) {
+			__atomic_store_n(&r->tail, r->tail + (r->mask + 1 - off), __ATOMIC_RELEASE);
+			continue;
+		}
+		*len = l;
+		return r->buf + off + SPSC_RING_HDR;
+	}
+}
+
+/**
+ * \brief Consumer: done with the record spsc_ring_front returned, its space goes back to the producer
+ */
+static inline void spsc_ring_release(struct spsc_ring* r, size_t len) {
+	__atomic_store_n(&r->tail, r->tail + SPSC_RING_HDR + _spsc_ring_align(len), __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Consumer: walk the records from the front without releasing any. Start with *pos = r->tail, NULL at the end
+ */
+static inline const void* spsc_ring_peek(struct spsc_ring* r, uint64_t* pos, size_t* len) {
+	const uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	while (*pos != head) {
+		const uint64_t off = *pos & r->mask;
+		const uint32_t l = *(const uint32_t*)(r->buf + off);
+		if (l == SPSC_RING_PAD) {
+			*pos += r->mask + 1 - off;
+			continue;
+		}
+		*len = l;
+		*pos += SPSC_RING_HDR + _spsc_ring_align(l);
+		return r->buf + off + SPSC_RING_HDR;
+	}
+	return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <netdb.h>
@@ -28,12 +29,17 @@
 #include <stdlib.h>
 
 #include "traceroute.h"
+#include "capture.h"
 #include "getopt_s.h"
 
 #ifdef __rtems__
 #	define ICMP_TIME_EXCEEDED ICMP_TIMXCEED
 #endif
 
+#define TR_TIMEOUT_MS 2000	/* How long to wait for the replies to a window of probes */
+#define TR_MAX_SILENT 8		/* Stop after this many hops in a row without a reply */
+#define TR_REPROBES 3		/* Tries at finding the branch of a multipath flow none of whose probes came back */
+
 struct traceroute_ctx {
 	int fd;
 	struct sockaddr_in local;
@@ -46,9 +52,38 @@ struct __attribute__((packed)) tr_packet {
 	uint32_t nsec;
 };
 
+enum tr_probe_state {
+	TR_PROBE_NONE = 0,
+	TR_PROBE_SENT,
+	TR_PROBE_ANSWERED,
+};
+
+struct tr_probe {
+	uint64_t sent_ns;
+	uint8_t state;	/* enum tr_probe_state */
+	int8_t addr;	/* Index into the hop's addrs of whoever answered */
+	uint8_t flow;	/* Added to opts->flow_id */
+};
+
+/* Everything one traceroute() call keeps track of */
+struct tr_state {
+	const struct traceroute_opts* opts;
+	struct traceroute_ctx ctx;
+	struct traceroute_result* result;
+	struct tr_probe* sent;	/* [ttl * max_k + k] */
+	int probes;		/* Copies of each flow */
+	int max_flows;
+	int max_k;		/* Probes per hop */
+	int next_k[UINT8_MAX + 1];	/* Next free probe index of each ttl */
+	int budget;		/* Left for extra multipath flows */
+	int dest_ttl;	/* Lowest ttl the destination itself answered */
+	in_addr_t src;
+	bool quiet, verbose;
+};
+
 static bool _tr_open(const struct traceroute_opts* opts, struct traceroute_ctx* ctx);
 static ssize_t _tr_make_ip_frame(const struct traceroute_opts* opts, const struct traceroute_ctx* ctx, struct ip* ipf, uint8_t ttl, size_t datalen);
-static void _tr_make_icmp(const struct traceroute_ctx* ctx, struct tr_packet* packet);
+static void _tr_make_icmp(const struct traceroute_ctx* ctx, struct tr_packet* packet, uint16_t seq, uint16_t flow);
 static void traceroute_help();
 
 #if EPICS
@@ -80,12 +115,31 @@ void traceroute_cmd(int argc, char** argv) {
 	struct traceroute_opts opts;
 	traceroute_opts_init(&opts);
 
+	const char* capture_path = NULL;
 	int opt;
-	while ((opt = getopt_s(argc, argv, "n:hv", &st)) != -1) {
+	while ((opt = getopt_s(argc, argv, "n:p:q:f:mb:hvw:", &st)) != -1) {
 		switch(opt) {
 		case 'n':
 			opts.max_hops = atoi(st.optarg);
 			break;
+		case 'p':
+			opts.window = atoi(st.optarg);
+			break;
+		case 'q':
+			opts.probes = atoi(st.optarg);
+			break;
+		case 'f':
+			opts.flow_id = strtoul(st.optarg, NULL, 0);
+			break;
+		case 'm':
+			opts.multipath = true;
+			break;
+		case 'b':
+			opts.budget = atoi(st.optarg);
+			break;
+		case 'w':
+			capture_path = st.optarg;
+			break;
 		case 'v':
 			opts.log_type = TR_LOG_VERBOSE;
 			break;
@@ -106,135 +160,386 @@ void traceroute_cmd(int argc, char** argv) {
 	opts.ip.sin_port = 0;
 	opts.ip.sin_family = AF_INET;
 
+	if (capture_path && !(opts.capture = capture_open(capture_path)))
+		return;
+
 	struct traceroute_result* result = NULL;
 	traceroute(&opts, &result);
 	traceroute_result_free(result);
+	capture_close(opts.capture);
 }
 
 static void traceroute_help() {
-	printf("Usage: traceroute [-n max_hops] addr\n");
+	printf("Usage: traceroute [-n max_hops] [-p parallel] [-q probes] [-f flow] [-m [-b budget]] [-w file.pcap] addr\n");
+	printf("  -p sets how many hops are probed at once (default 32), 1 probes one hop at a time\n");
+	printf("  -q sets how many probes go to each hop (default 3) for its RTT and loss\n");
+	printf("  Probes all carry the -f flow id, so load balancers send them down the same path.\n");
+	printf("  -m tries more flows per hop until every load balanced branch has shown up, with loss per branch,\n");
+	printf("  spending at most -b probes (default 4096) on the extra flows\n");
 }
 
 void traceroute_opts_init(struct traceroute_opts* opts) {
 	memset(opts, 0, sizeof(*opts));
 	opts->log_type = TR_LOG_FULL;
 	opts->max_hops = 128;
+	opts->window = 32;
+	opts->probes = 3;
+	opts->flow_id = 0x5A5A;
+	opts->budget = 4096;
 }
 
 void traceroute_result_free(struct traceroute_result* result) {
-	if (!result)
+	free(result);
+}
+
+/* Folds one reply into its hop, returns the index of the address that sent it */
+static int _tr_hop_add(struct traceroute_hop* h, in_addr_t from, uint64_t rtt_ns) {
+	const float ms = rtt_ns / 1e6f;
+	h->min_ms = !h->received || ms < h->min_ms ? ms : h->min_ms;
+	h->max_ms = ms > h->max_ms ? ms : h->max_ms;
+	h->avg_ms += (ms - h->avg_ms) / ++h->received;
+
+	for (int i = 0; i < h->num_addrs; ++i)
+		if (h->addrs[i] == from)
+			return i;
+	if (h->num_addrs >= TR_MAX_ADDRS)
+		return -1;
+	h->addrs[h->num_addrs] = from;
+	return h->num_addrs++;
+}
+
+static void _tr_print_hop(int ttl, const struct traceroute_hop* h, bool multipath) {
+	char addr[INET_ADDRSTRLEN] = "*";
+	if (h->num_addrs) {
+		const struct in_addr a = {h->addrs[0]};
+		inet_ntop(AF_INET, &a, addr, sizeof(addr));
+	}
+	printf("%2d %-15s", ttl, addr);
+	if (h->received)
+		printf("  %.3f/%.3f/%.3f ms", h->min_ms, h->avg_ms, h->max_ms);
+	printf("  %d/%d lost", h->sent - h->received, h->sent);
+	if (!multipath) {
+		for (int i = 1; i < h->num_addrs; ++i) {
+			const struct in_addr a = {h->addrs[i]};
+			printf(i == 1 ? "  also %s" : ", %s", inet_ntoa(a));
+		}
+		printf("\n");
 		return;
+	}
 
-	for (struct traceroute_node* n = result->first; n;) {
-		struct traceroute_node* o = n;
-		n = n->next;
-		free(o);
+	printf("  %d flows%s", h->flows, h->partial ? ", out of budget" : "");
+	if (h->unattributed)
+		printf(", %d lost on flows that never answered", h->unattributed);
+	printf("\n");
+	for (int i = 0; i < h->num_addrs && h->num_addrs > 1; ++i) {
+		const struct in_addr a = {h->addrs[i]};
+		printf("     %-15s  %d/%d lost\n", inet_ntoa(a), h->branch_sent[i] - h->branch_received[i], h->branch_sent[i]);
 	}
-	free(result);
 }
 
-bool traceroute(const struct traceroute_opts* opts, struct traceroute_result** resptr) {
-	struct traceroute_ctx ctx;
-	if (!_tr_open(opts, &ctx))
-		return false;
+/**
+ * Works out which probe a reply is for, returns its sequence number or -1 if it isn't ours. Echo replies
+ * echo it back, time exceeded messages quote our IP header and the first 8 bytes of the probe behind it
+ */
+static int _tr_match(const struct traceroute_ctx* ctx, const uint8_t* data, ssize_t len, bool* reached) {
+	const struct ip* hdr = (const struct ip*)data;
+	const size_t hl = hdr->ip_hl * 4;
+	if (len < (ssize_t)(hl + ICMP_MINLEN))
+		return -1;
+
+	const struct icmp* packet = (const struct icmp*)(data + hl);
+	if (packet->icmp_type == ICMP_ECHOREPLY) {
+		if (packet->icmp_hun.ih_idseq.icd_id != ctx->ident)
+			return -1;
+		*reached = true;
+		return ntohs(packet->icmp_hun.ih_idseq.icd_seq);
+	}
+	if (packet->icmp_type != ICMP_TIME_EXCEEDED || len < (ssize_t)(hl + ICMP_MINLEN + sizeof(struct ip)))
+		return -1;
+
+	const struct ip* quoted = &packet->icmp_ip;
+	const size_t qhl = quoted->ip_hl * 4;
+	if (quoted->ip_p != IPPROTO_ICMP || len < (ssize_t)(hl + ICMP_MINLEN + qhl + ICMP_MINLEN))
+		return -1;
+	const struct icmp* probe = (const struct icmp*)((const uint8_t*)quoted + qhl);
+	if (probe->icmp_type != ICMP_ECHO || probe->icmp_hun.ih_idseq.icd_id != ctx->ident)
+		return -1;
+	*reached = false;
+	return ntohs(probe->icmp_hun.ih_idseq.icd_seq);
+}
 
-	const bool quiet = opts->log_type < TR_LOG_FULL;
-	const bool verbose = opts->log_type == TR_LOG_VERBOSE;
-
-	struct traceroute_result* result = (struct traceroute_result*)calloc(1, sizeof(struct traceroute_result));
-	result->first = NULL;
-	result->hops = 0;
-	struct traceroute_node* last = NULL;
-
-	int hops = opts->max_hops, retries = 10;
-	uint8_t ttl = 1;
-	while(hops > 0) {
-		/* We've retried too many times, probably lost our connection :( */
-		if (retries <= 0) {
-			if (!quiet)
-				printf("Max retries exceeded, exiting..\n");
-			break;
-		}
+/* Send the next probe of ttl on flow */
+static void _tr_probe(struct tr_state* st, int ttl, int flow) {
+	const struct traceroute_opts* opts = st->opts;
+	if (st->next_k[ttl] >= st->max_k)
+		return; /* Out of sequence numbers for this hop */
+	const int k = st->next_k[ttl]++;
+	char data[sizeof(struct ip) + sizeof(struct tr_packet)];
+	const ssize_t len = _tr_make_ip_frame(opts, &st->ctx, (struct ip*)data, ttl, sizeof(struct icmp));
+	_tr_make_icmp(&st->ctx, (struct tr_packet*)(data + sizeof(struct ip)), k << 8 | ttl, opts->flow_id + flow);
+
+	struct tr_probe* p = &st->sent[ttl * st->max_k + k];
+	p->flow = flow;
+	p->sent_ns = time_now_ns();
+	if (sendto(st->ctx.fd, data, len, 0, (struct sockaddr*)&opts->ip, sizeof(opts->ip)) < len) {
+		if (!st->quiet)
+			perror("Send failed");
+		return; /* Shows up as a silent probe */
+	}
+	p->state = TR_PROBE_SENT;
+	++st->result->hop[ttl - 1].sent;
+	if (opts->capture)
+		capture_icmp(opts->capture, time_realtime_ns(), st->src, opts->ip.sin_addr.s_addr, ttl, data + sizeof(struct ip),
+			len - sizeof(struct ip), NULL, 0);
+}
 
-		char data[4096];
+/* Send every copy of the next flow of ttl */
+static void _tr_flow(struct tr_state* st, int ttl) {
+	struct traceroute_hop* h = &st->result->hop[ttl - 1];
+	for (int r = 0; r < st->probes; ++r)
+		_tr_probe(st, ttl, h->flows);
+	++h->flows;
+}
 
-		/* Build IP frame + ICMP payload */
-		const ssize_t len = _tr_make_ip_frame(opts, &ctx, (struct ip*)data, ttl, sizeof(struct icmp));
-		_tr_make_icmp(&ctx, (struct tr_packet*)(data + sizeof(struct ip)));
+/* Collect replies until every probe from base up to the destination is answered or time is up */
+static void _tr_collect(struct tr_state* st, int base, int top) {
+	const struct traceroute_opts* opts = st->opts;
+	const uint64_t deadline = time_now_ns() + TR_TIMEOUT_MS * 1000000ULL;
+	for (;;) {
+		int missing = 0;
+		for (int ttl = base; ttl <= top && ttl <= st->dest_ttl; ++ttl)
+			missing += st->result->hop[ttl - 1].sent - st->result->hop[ttl - 1].received;
+		const uint64_t now = time_now_ns();
+		if (!missing || now >= deadline)
+			return;
 
-		if (sendto(ctx.fd, data, len, 0, (struct sockaddr*)&opts->ip, sizeof(opts->ip)) < len) {
-			if (!quiet)
-				perror("Send failed");
-			if (verbose)
-				printf("Retry %d...\n", retries);
-			retries--;
-			continue;
+		struct pollfd pfd = {st->ctx.fd, POLLIN, 0};
+		const int r = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+		if (r < 0 && errno != EINTR) {
+			if (!st->quiet)
+				perror("poll failed");
+			return;
 		}
+		if (r <= 0)
+			continue;
 
-		/* Listen for the reply */
+		uint8_t data[4096];
 		struct sockaddr_in fromaddr;
 		socklen_t fromlen = sizeof(fromaddr);
-		ssize_t recv;
-	recvagain:
-		if ((recv = recvfrom(ctx.fd, data, len, 0, (struct sockaddr*)&fromaddr, &fromlen))) {
-			struct ip* hdr = (struct ip*)data;
-			struct icmp* packet = (struct icmp*)(data + hdr->ip_hl * 4);
-
-			/* Failure, we'll retry */
-			if (recv < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					goto done; /* Increase ttl, send again */
-				if (!quiet)
-					perror("Recv failed, packet lost");
-				if (verbose)
-					printf("Retry %d...\n", retries);
-				retries--;
+		const ssize_t recv = recvfrom(st->ctx.fd, data, sizeof(data), MSG_DONTWAIT, (struct sockaddr*)&fromaddr, &fromlen);
+		const uint64_t at = time_now_ns();
+		if (recv < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && !st->quiet)
+				perror("Recv failed");
+			continue;
+		}
+		if (opts->capture)
+			capture_ip(opts->capture, time_realtime_ns(), data, recv);
+
+		bool reached = false;
+		const int seq = _tr_match(&st->ctx, data, recv, &reached);
+		const int ttl = seq & 0xFF, k = seq >> 8;
+		if (seq < 0 || ttl < base || ttl > top || k >= st->max_k)
+			continue; /* Not ours or late */
+		struct tr_probe* p = &st->sent[ttl * st->max_k + k];
+		if (p->state != TR_PROBE_SENT)
+			continue; /* Duplicate */
+
+		const in_addr_t from = fromaddr.sin_addr.s_addr;
+		p->state = TR_PROBE_ANSWERED;
+		p->addr = _tr_hop_add(&st->result->hop[ttl - 1], from, at - p->sent_ns);
+		if (reached && from == opts->ip.sin_addr.s_addr && ttl < st->dest_ttl)
+			st->dest_ttl = ttl;
+		if (st->verbose)
+			printf("ttl %d flow %d answered by %s\n", ttl, p->flow, inet_ntoa(fromaddr.sin_addr));
+	}
+}
+
+/**
+ * Multipath detection algorithm stopping points (Veitch et al.): once k branches have shown up at a hop,
+ * s_mda[k] flows without a new one rule out another branch with 95% confidence
+ */
+static const int s_mda[] = {0, 6, 11, 16, 21, 27, 33, 38, 44};
+
+/* Try more flows wherever a hop may still be hiding branches, until every hop is sure or the budget is gone */
+static void _tr_branches(struct tr_state* st, int base, int top) {
+	for (;;) {
+		bool sent = false;
+		for (int ttl = base; ttl <= top && ttl < st->dest_ttl; ++ttl) {
+			struct traceroute_hop* h = &st->result->hop[ttl - 1];
+			if (!h->num_addrs || h->flows >= s_mda[h->num_addrs])
+				continue; /* Silent, or every branch accounted for */
+			const int want = s_mda[h->num_addrs] < st->max_flows ? s_mda[h->num_addrs] : st->max_flows;
+			const int cost = (want - h->flows) * st->probes;
+			h->partial = want <= h->flows || (st->opts->budget && cost > st->budget);
+			if (h->partial)
 				continue;
+			while (h->flows < want)
+				_tr_flow(st, ttl);
+			st->budget -= cost;
+			sent = true;
+		}
+		if (!sent)
+			return;
+		_tr_collect(st, base, top);
+	}
+}
+
+/* Which of the hop's addrs answered each flow, -1 where none of its probes came back */
+static void _tr_flow_addrs(const struct tr_state* st, int ttl, int8_t* addrs) {
+	memset(addrs, -1, TR_MAX_FLOWS);
+	const struct tr_probe* p = &st->sent[ttl * st->max_k];
+	for (int k = 0; k < st->next_k[ttl]; ++k) {
+		if (p[k].state == TR_PROBE_ANSWERED && addrs[p[k].flow] < 0)
+			addrs[p[k].flow] = p[k].addr;
+	}
+}
+
+/**
+ * A flow that lost all its probes still went down one of the branches, and that branch's loss is what we
+ * are after. Keep probing such flows until they answer, so the loss can be put on the right branch
+ */
+static void _tr_reprobe(struct tr_state* st, int base, int top) {
+	for (int round = 0; round < TR_REPROBES; ++round) {
+		bool sent = false;
+		for (int ttl = base; ttl <= top && ttl < st->dest_ttl; ++ttl) {
+			const struct traceroute_hop* h = &st->result->hop[ttl - 1];
+			if (!h->num_addrs)
+				continue; /* Router doesn't answer at all, no use asking again */
+			int8_t addrs[TR_MAX_FLOWS];
+			_tr_flow_addrs(st, ttl, addrs);
+			for (int f = 0; f < h->flows && st->next_k[ttl] < st->max_k; ++f) {
+				if (addrs[f] >= 0 || (st->opts->budget && st->budget <= 0))
+					continue;
+				_tr_probe(st, ttl, f);
+				--st->budget;
+				sent = true;
 			}
+		}
+		if (!sent)
+			return;
+		_tr_collect(st, base, top);
+	}
+}
 
-			/* Probably not our data! */
-			if (recv < sizeof(struct ip) + sizeof(uint64_t))
-				goto recvagain;
+/* Loss per branch, from the probes on every flow each address answered for */
+static void _tr_branch_loss(struct tr_state* st, int ttl) {
+	struct traceroute_hop* h = &st->result->hop[ttl - 1];
+	int8_t addrs[TR_MAX_FLOWS];
+	_tr_flow_addrs(st, ttl, addrs);
+	const struct tr_probe* p = &st->sent[ttl * st->max_k];
+	for (int k = 0; k < st->next_k[ttl]; ++k) {
+		if (p[k].state == TR_PROBE_NONE)
+			continue;
+		const int addr = addrs[p[k].flow];
+		if (addr < 0) {
+			++h->unattributed; /* Nothing ever came back on this flow, no telling which branch lost it */
+			continue;
+		}
+		++h->branch_sent[addr];
+		h->branch_received[addr] += p[k].state == TR_PROBE_ANSWERED;
+	}
+}
 
-			/* Check if it's actually ours and what we expect... */
-			if (packet->icmp_type != ICMP_ECHOREPLY && packet->icmp_type != ICMP_TIME_EXCEEDED && packet->icmp_hun.ih_idseq.icd_id != ctx.ident)
-				goto recvagain;
+bool traceroute(const struct traceroute_opts* opts, struct traceroute_result** resptr) {
+	struct tr_state st;
+	memset(&st, 0, sizeof(st));
+	st.opts = opts;
+	st.quiet = opts->log_type < TR_LOG_FULL;
+	st.verbose = opts->log_type == TR_LOG_VERBOSE;
+	st.probes = opts->probes < 1 ? 1 : opts->probes > TR_MAX_PROBES ? TR_MAX_PROBES : opts->probes;
+	st.budget = opts->budget;
+
+	/* Probe k of a hop goes in the top byte of the sequence number, that caps the probes we can tell apart */
+	st.max_flows = opts->multipath ? 255 / st.probes : 1;
+	st.max_flows = st.max_flows < TR_MAX_FLOWS ? st.max_flows : TR_MAX_FLOWS;
+	st.max_k = opts->multipath ? 255 : st.probes;
+	const int max_hops = opts->max_hops < UINT8_MAX ? opts->max_hops : UINT8_MAX;
+	const int window = opts->window > 0 ? opts->window : 1;
+	const int first_flows = opts->multipath ? s_mda[1] : 1;
+
+	/* Room for every hop up front, trimmed once we know how far the destination is. st.sent remembers when each
+	 * probe left, time exceeded messages don't quote the timestamp we put in it */
+	st.result = calloc(1, sizeof(struct traceroute_result) + max_hops * sizeof(struct traceroute_hop));
+	st.sent = calloc((size_t)(max_hops + 1) * st.max_k, sizeof(struct tr_probe));
+	if (!st.result || !st.sent) {
+		printf("Out of memory\n");
+		free(st.result);
+		free(st.sent);
+		return false;
+	}
 
-			struct traceroute_node* n = (struct traceroute_node*)calloc(1, sizeof(struct traceroute_node));
-			if (last)
-				last->next = n;
-			last = n;
-			if (!result->first)
-				result->first = last;
-			++result->hops;
+	if (!_tr_open(opts, &st.ctx)) {
+		free(st.result);
+		free(st.sent);
+		return false;
+	}
 
-			last->in_addr = fromaddr.sin_addr.s_addr;
-			strncpy(last->addr, inet_ntoa(fromaddr.sin_addr), sizeof(last->addr)-1);
+	/* The socket isn't bound, ask the routing table which address the probes leave from */
+	st.src = opts->capture ? capture_local_addr(opts->ip.sin_addr.s_addr) : INADDR_ANY;
 
-			if (!quiet)
-				printf("%2d %s\n", result->hops, last->addr);
+	st.dest_ttl = max_hops + 1;
+	int silent = 0;		/* Unanswered ttls since the last answer */
+	for (int base = 1; base <= max_hops && base < st.dest_ttl; base += window) {
+		const int top = base + window - 1 < max_hops ? base + window - 1 : max_hops;
 
-			/* If we get ECHOREPLY, we've reached out destination and are finished */
-			if (packet->icmp_code == ICMP_ECHOREPLY && fromaddr.sin_addr.s_addr == opts->ip.sin_addr.s_addr)
-				break;
+		/* Fire the whole window at once, one flow of each ttl after the other */
+		for (int f = 0; f < first_flows; ++f) {
+			for (int ttl = base; ttl <= top; ++ttl)
+				_tr_flow(&st, ttl);
+		}
+		_tr_collect(&st, base, top);
+		if (opts->multipath) {
+			_tr_branches(&st, base, top);
+			_tr_reprobe(&st, base, top);
 		}
-	done:
-		--hops;
-		retries = 10;
-		++ttl;
+
+		/* Give up on paths that have gone quiet, the destination is probably filtering us */
+		for (int ttl = base; ttl <= top && ttl < st.dest_ttl; ++ttl)
+			silent = st.result->hop[ttl - 1].received ? 0 : silent + 1;
+		if (st.dest_ttl > top && silent >= TR_MAX_SILENT) {
+			if (!st.quiet)
+				printf("No replies from the last %d hops, exiting..\n", silent);
+			break;
+		}
+	}
+
+	close(st.ctx.fd);
+	struct traceroute_result* result = st.result;
+
+	/* How far the path gets before a filter or black hole is worth as much as the whole path */
+	result->reached = st.dest_ttl <= max_hops;
+	result->hops = result->reached ? st.dest_ttl : 0;
+	for (int ttl = 1; !result->reached && ttl <= max_hops; ++ttl)
+		result->hops = result->hop[ttl - 1].received ? ttl : result->hops;
+
+	for (int ttl = 1; ttl <= result->hops; ++ttl) {
+		_tr_branch_loss(&st, ttl);
+		if (!st.quiet)
+			_tr_print_hop(ttl, &result->hop[ttl - 1], opts->multipath);
 	}
+	if (!result->reached && !st.quiet)
+		printf("Destination not reached\n");
+	free(st.sent);
 
-	close(ctx.fd);
-	if (hops > 0)
-		*resptr = result;
-	else
-		free(result);
-	return hops > 0;
+	struct traceroute_result* trimmed = realloc(result, sizeof(struct traceroute_result) + result->hops * sizeof(struct traceroute_hop));
+	*resptr = trimmed ? trimmed : result;
+	return true;
+}
+
+/**
+ * Every traceroute gets its own ident, or two running at once would take each other's replies for their own.
+ * Same scheme as ping sessions with the top bit flipped, so it stays clear of those in the same process
+ */
+static uint16_t _tr_ident() {
+	static uint32_t counter = 0;
+	const uint32_t n = __sync_fetch_and_add(&counter, 1);
+	return (uint16_t)(getpid() * 2654435761U + n * 40503U) ^ 0x8000;
 }
 
 static bool _tr_open(const struct traceroute_opts* opts, struct traceroute_ctx* ctx) {
 	const bool quiet = opts->log_type < TR_LOG_FULL;
-	socklen_t sockl;
+	socklen_t sockl = sizeof(ctx->local);
 	int opt = 1;
 
 	ctx->fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
@@ -244,11 +549,18 @@ static bool _tr_open(const struct traceroute_opts* opts, struct traceroute_ctx*
 		return false;
 	}
 
-	ctx->ident = 5930;
+	ctx->ident = _tr_ident();
+
+	/* Only wake up for our own echo replies and errors about our probes. Optional, replies are checked anyway */
+	icmp_attach_filter(ctx->fd, ctx->ident);
+
+	/* Every probe of a window may come back at once, more so when the path is shorter than the window */
+	int rcvbuf = 1024 * 1024;
+	setsockopt(ctx->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
 	struct timeval tv;
-	tv.tv_sec = 2;
-	tv.tv_usec = 0;
+	tv.tv_sec = TR_TIMEOUT_MS / 1000;
+	tv.tv_usec = TR_TIMEOUT_MS % 1000 * 1000;
 	if (setsockopt(ctx->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
 		if (!quiet)
 			perror("Failed to set SO_RCVTIMEO");
@@ -301,20 +613,29 @@ static ssize_t _tr_make_ip_frame(const struct traceroute_opts* opts, const struc
 }
 
 
-static void _tr_make_icmp(const struct traceroute_ctx* ctx, struct tr_packet* packet) {
+/**
+ * seq says which probe this is, replies carry or quote it. Load balancers pick a path from the addresses,
+ * the protocol and the first 4 bytes after the IP header, which for ICMP is type, code and checksum (Paris
+ * traceroute). The checksum is pinned to flow by fixing up the first payload word, so probes that only
+ * differ in seq still hash alike
+ */
+static void _tr_make_icmp(const struct traceroute_ctx* ctx, struct tr_packet* packet, uint16_t seq, uint16_t flow) {
 	memset(packet, 0, sizeof(*packet));
     packet->icmp_packet.icmp_type = ICMP_ECHO;
     packet->icmp_packet.icmp_code = 0;
     packet->icmp_packet.icmp_hun.ih_idseq.icd_id = ctx->ident;
-    packet->icmp_packet.icmp_hun.ih_idseq.icd_seq = 0;
+    packet->icmp_packet.icmp_hun.ih_idseq.icd_seq = htons(seq);
 
 	struct timespec sentat = time_now();
 
     packet->sec = sentat.tv_sec;
     packet->nsec = sentat.tv_nsec;
-	packet->icmp_packet.icmp_cksum = 0;
 
-    packet->icmp_packet.icmp_cksum = ip_cksum(&packet->icmp_packet, sizeof(packet->icmp_packet));
+	/* Whatever the pad word is, header plus pad plus checksum have to sum to 0xFFFF */
+	const uint16_t cksum = htons(flow);
+	const uint16_t pad = ~ones_sum(ip_cksum_partial(&packet->icmp_packet, sizeof(packet->icmp_packet)), cksum);
+	memcpy((uint8_t*)&packet->icmp_packet + ICMP_MINLEN, &pad, sizeof(pad));
+	packet->icmp_packet.icmp_cksum = cksum;
 }
 
 #ifdef TRACEROUTE_MAIN
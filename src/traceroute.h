@@ -10,6 +10,9 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+
+struct capture;
 
 enum TracerouteLog {
 	TR_LOG_NONE,
@@ -19,25 +22,44 @@ enum TracerouteLog {
 
 struct traceroute_opts {
 	struct sockaddr_in ip;
-	int max_hops;		/* Max number of hops */
+	int max_hops;		/* Max number of hops, at most 255 */
+	int window;			/* Hops probed at once, replies are told apart by the probe they quote */
+	int probes;			/* Probes sent to each hop (to each flow with multipath), all at once, at most TR_MAX_PROBES */
+	uint16_t flow_id;	/* ICMP checksum of every probe, load balancers hash it so all probes follow one path */
+	bool multipath;		/* Try more flows (flow_id + 1, + 2...) at each hop until every branch has shown up */
+	int budget;			/* Most probes multipath spends on extra flows, 0 for no limit */
 	int log_type;
+	struct capture* capture;	/* Every probe and reply is captured here if set, see capture.h */
 };
 
-struct traceroute_node {
-	char addr[64];
-	in_addr_t in_addr;
-	struct traceroute_node* next;
+#define TR_MAX_PROBES 16	/* Per hop and flow */
+#define TR_MAX_FLOWS 64		/* Per hop with multipath */
+#define TR_MAX_ADDRS 8		/* Responders kept per hop, more show up when the path is load balanced */
+
+struct traceroute_hop {
+	int sent;
+	int received;		/* 0 for a silent hop */
+	float min_ms, avg_ms, max_ms;
+	int num_addrs;
+	in_addr_t addrs[TR_MAX_ADDRS];	/* Everyone that answered, in order of first reply */
+	int branch_sent[TR_MAX_ADDRS];	/* Probes on the flows each address answered for */
+	int branch_received[TR_MAX_ADDRS];
+	int unattributed;	/* Probes on flows that never answered, lost on a branch we can't tell */
+	int flows;			/* Flow ids tried */
+	bool partial;		/* Multipath ran out of budget before it could rule out more branches here */
 };
 
 struct traceroute_result {
-	int hops;
-	struct traceroute_node* first;
+	int hops;		/* Up to and including the destination, or the last hop that answered if it wasn't reached */
+	bool reached;	/* The destination answered */
+	struct traceroute_hop hop[];	/* hop[i] is ttl i + 1 */
 };
 
 void traceroute_opts_init(struct traceroute_opts* opts);
 
 void traceroute_cmd(int argc, char** argv);
 
+/* On success *result holds every hop to the destination and must be freed by the caller */
 bool traceroute(const struct traceroute_opts* opts, struct traceroute_result** result);
 
 void traceroute_result_free(struct traceroute_result* result);
@@ -4,6 +4,7 @@
 #include <memory.h>
 #include <stdint.h>
 #include <time.h>
+#include <math.h>
 
 #include <netinet/in_systm.h>
 #include <sys/socket.h>
@@ -17,24 +18,197 @@
 #include "iputils.h"
 #include "getopt_s.h"
 
+enum wtfpl_verdict {
+	WTFPL_UNDECIDED = 0,	/* Ran out of samples before the test could tell */
+	WTFPL_CLEAN,			/* Loss at or below opts.good_loss */
+	WTFPL_LOSSY,			/* Loss at or above opts.bad_loss */
+};
+
 typedef struct wtfpl_node {
 	in_addr_t addr;
 	struct wtfpl_node* next;
 	int sent;
 	int lost;
 	float pl; /* Packet loss percentage (i.e. 1.0 for 100%) */
+	int verdict; /* enum wtfpl_verdict */
 } wtfpl_node_t;
 
 typedef struct wtfpl_result {
 	in_addr_t suspect;
+	int confirmed;	/* Loss was decided at a hop after the suspect too */
 	struct wtfpl_node* first; /* In order of test */
 } wtfpl_result_t;
 
 typedef struct wtfpl_opts {
 	in_addr_t addr;
-	int samples;	/* How many packets we trace to each host */
+	int samples;	/* Most packets we send to each host, and the size of the rolling window */
+	float good_loss;	/* Loss rates the sequential test tells apart, a hop is decided as soon as the */
+	float bad_loss;		/* evidence is strong enough, WTFPL_ERROR decides how strong that is */
+	float interval;	/* Between packets to one hop, all hops are pinged at once */
+	float time;		/* Keep monitoring this long (seconds), 0 stops after one window */
 } wtfpl_opts_t;
 
+#define WTFPL_REPORT_NS (5 * 1000000000ULL)	/* How often the hop table is printed while monitoring */
+#define WTFPL_ERROR 0.05	/* Odds of calling a good hop lossy, and a lossy one good */
+
+/* The last samples outcomes of one address, RTTs in ms, negative for a lost request */
+struct wtfpl_window {
+	in_addr_t addr;
+	int ttl;		/* First hop it showed up at */
+	float* rtt;
+	int head;
+	int count;
+	int lost;
+	uint64_t total;
+	uint64_t total_lost;
+	double llr;		/* Log likelihood ratio of bad_loss over good_loss since the last verdict */
+	int verdict;	/* enum wtfpl_verdict */
+};
+
+struct wtfpl_monitor {
+	const struct wtfpl_opts* opts;
+	struct wtfpl_window* win;	/* In hop order */
+	int num;
+	int suspect;		/* Index into win, -1 for none */
+	bool confirmed;		/* A hop after the suspect is decided lossy as well */
+	uint64_t next_report;
+	uint64_t deadline;	/* 0 to stop after one window */
+	double llr_lost, llr_recv;	/* What one lost or received packet adds to the llr */
+	double llr_bad, llr_good;	/* Thresholds for each verdict */
+};
+
+static void _wtfpl_push(struct wtfpl_window* w, int size, float rtt) {
+	if (w->count == size)
+		w->lost -= w->rtt[w->head] < 0;
+	else
+		++w->count;
+	w->rtt[w->head] = rtt;
+	w->head = (w->head + 1) % size;
+	w->lost += rtt < 0;
+	++w->total;
+	w->total_lost += rtt < 0;
+}
+
+static float _wtfpl_pl(const struct wtfpl_window* w) {
+	return w->count ? w->lost / (float)w->count : 0;
+}
+
+/**
+ * Wald's sequential probability ratio test, good_loss against bad_loss. Obvious loss is decided in a few
+ * packets and a clean hop in a few dozen, rather than always sending samples packets
+ */
+static void _wtfpl_sprt_init(struct wtfpl_monitor* m, const struct wtfpl_opts* opts) {
+	const double p0 = opts->good_loss, p1 = opts->bad_loss;
+	m->llr_lost = log(p1 / p0);
+	m->llr_recv = log((1 - p1) / (1 - p0));
+	m->llr_bad = log((1 - WTFPL_ERROR) / WTFPL_ERROR);
+	m->llr_good = log(WTFPL_ERROR / (1 - WTFPL_ERROR));
+}
+
+/* Returns true once the window has a verdict */
+static bool _wtfpl_sprt(const struct wtfpl_monitor* m, struct wtfpl_window* w, bool lost) {
+	w->llr += lost ? m->llr_lost : m->llr_recv;
+	if (w->llr > m->llr_good && w->llr < m->llr_bad)
+		return false;
+	w->verdict = w->llr >= m->llr_bad ? WTFPL_LOSSY : WTFPL_CLEAN;
+	w->llr = 0;
+	return true;
+}
+
+/**
+ * The first lossy hop whose loss carries on all the way down the path. Loss that goes away further down is
+ * the router not bothering to answer pings to itself (ICMP rate limiting), not packets going missing.
+ * Until some hop after it is decided lossy too, rate limiting can't be ruled out and it is unconfirmed
+ */
+static int _wtfpl_suspect(const struct wtfpl_monitor* m, bool* confirmed) {
+	int suspect = -1, lossy = 0;
+	for (int i = m->num - 1; i >= 0; --i) {
+		if (m->win[i].verdict == WTFPL_CLEAN)
+			break;
+		if (m->win[i].verdict == WTFPL_LOSSY) {
+			suspect = i;
+			++lossy;
+		}
+	}
+	*confirmed = lossy > 1;
+	return suspect;
+}
+
+static const char* const s_verdicts[] = {"?", "ok", "LOSS"};
+
+static void _wtfpl_print(const struct wtfpl_monitor* m) {
+	printf("ttl address          loss%%   sent    last     avg    best   worst  verdict\n");
+	for (int i = 0; i < m->num; ++i) {
+		const struct wtfpl_window* w = &m->win[i];
+		const int size = m->opts->samples;
+		float sum = 0, best = 0, worst = 0, last = -1;
+		int n = 0;
+		for (int j = 0; j < w->count; ++j) {
+			const float rtt = w->rtt[(w->head - 1 - j + size) % size];
+			last = j == 0 ? rtt : last;
+			if (rtt < 0)
+				continue;
+			best = !n || rtt < best ? rtt : best;
+			worst = rtt > worst ? rtt : worst;
+			sum += rtt;
+			++n;
+		}
+		bool clean_after = false;
+		for (int j = i + 1; j < m->num; ++j)
+			clean_after |= m->win[j].verdict == WTFPL_CLEAN;
+		const struct in_addr a = {w->addr};
+		printf("%3d %-15s %6.1f %6llu %7.2f %7.2f %7.2f %7.2f  %s%s\n", w->ttl, inet_ntoa(a), 100.f * _wtfpl_pl(w),
+			(unsigned long long)w->total, last, n ? sum / n : 0.f, best, worst, s_verdicts[w->verdict],
+			i == m->suspect ? (m->confirmed ? "  <--" : "  <-- (unconfirmed)") : w->verdict == WTFPL_LOSSY && clean_after ? "  (rate limited?)" : "");
+	}
+}
+
+/* Every reply or loss lands here as soon as the engine knows about it */
+static int _wtfpl_record(void* arg, const struct ping_record* rec) {
+	struct wtfpl_monitor* m = (struct wtfpl_monitor*)arg;
+	if (rec->flags & (PING_REC_DUP | PING_REC_LATE))
+		return PING_RECORD_CONTINUE; /* Counted already */
+
+	int i = 0;
+	while (i < m->num && m->win[i].addr != rec->target)
+		++i;
+	if (i == m->num)
+		return PING_RECORD_CONTINUE;
+	struct wtfpl_window* w = &m->win[i];
+	const bool lost = rec->flags & PING_REC_LOST;
+	_wtfpl_push(w, m->opts->samples, lost ? -1.f : rec->rtt_ns / 1e6f);
+
+	/* A one off diagnosis is done with a hop once it has a verdict. Monitoring starts the test over,
+	 * so the verdict follows the path as it changes */
+	bool decided = false;
+	if (m->deadline || w->verdict == WTFPL_UNDECIDED)
+		decided = _wtfpl_sprt(m, w, lost);
+
+	bool confirmed;
+	const int suspect = _wtfpl_suspect(m, &confirmed);
+	if (suspect != m->suspect || confirmed != m->confirmed) {
+		char b[128];
+		if (suspect >= 0) {
+			const struct in_addr a = {m->win[suspect].addr};
+			printf("[%s] suspect is now hop %d %s, %.1f%% loss%s\n", time_now_str(b, sizeof(b)), m->win[suspect].ttl,
+				inet_ntoa(a), 100.f * _wtfpl_pl(&m->win[suspect]), confirmed ? "" : ", unconfirmed");
+		}
+		else
+			printf("[%s] no hop is losing packets\n", time_now_str(b, sizeof(b)));
+		m->suspect = suspect;
+		m->confirmed = confirmed;
+	}
+
+	const uint64_t now = time_now_ns();
+	if (m->deadline && now >= m->next_report) {
+		_wtfpl_print(m);
+		m->next_report = now + WTFPL_REPORT_NS;
+	}
+	if (m->deadline)
+		return now < m->deadline ? PING_RECORD_CONTINUE : PING_RECORD_STOP;
+	return decided ? PING_RECORD_STOP_TARGET : PING_RECORD_CONTINUE;
+}
+
 int wtfpl(struct wtfpl_opts* opts, wtfpl_result_t** result) {
 	struct traceroute_opts tro;
 	traceroute_opts_init(&tro);
@@ -49,58 +223,103 @@ int wtfpl(struct wtfpl_opts* opts, wtfpl_result_t** result) {
 		return 0;
 	}
 
-	if (!tres) {
+	if (!tres || !tres->hops) {
 		printf("No route\n");
+		traceroute_result_free(tres);
 		return 0;
 	}
+	if (!tres->reached)
+		printf("Destination not reached, watching the path up to hop %d\n", tres->hops);
 
-	int i = 1;
-	struct wtfpl_node* lastn = NULL;
-	struct wtfpl_node* first = NULL;
-	for(struct traceroute_node* n = tres->first; n; n = n->next, ++i) {
-		printf("%d %s", i, n->addr);
-		struct ping_opts popts;
-		icmp_ping_opts_init(&popts);
-		popts.addr = n->in_addr;
-		popts.num_packets = opts->samples;
-		popts.interval = 0.5;
-
-		struct ping_stats stats;
-		if (!icmp_ping(&popts, &stats)) {
-			printf(" failed\n");
+	/* One window per address, a router can answer for more than one ttl */
+	struct wtfpl_result* res = NULL;
+	struct wtfpl_monitor m;
+	memset(&m, 0, sizeof(m));
+	m.opts = opts;
+	m.suspect = -1;
+	_wtfpl_sprt_init(&m, opts);
+	m.win = calloc(tres->hops, sizeof(struct wtfpl_window));
+	in_addr_t* addrs = calloc(tres->hops, sizeof(in_addr_t));
+	float* rtts = calloc((size_t)tres->hops * opts->samples, sizeof(float));
+	if (!m.win || !addrs || !rtts) {
+		printf("Out of memory\n");
+		goto done;
+	}
+	for (int i = 0; i < tres->hops; ++i) {
+		const struct traceroute_hop* h = &tres->hop[i];
+		if (!h->num_addrs)
+			continue; /* Silent hop, nothing to ping */
+		int j = 0;
+		while (j < m.num && addrs[j] != h->addrs[0])
+			++j;
+		if (j < m.num)
 			continue;
-		}
+		addrs[m.num] = h->addrs[0];
+		m.win[m.num].addr = h->addrs[0];
+		m.win[m.num].ttl = i + 1;
+		m.win[m.num].rtt = rtts + (size_t)m.num * opts->samples;
+		++m.num;
+	}
 
+	/* All hops at once on one socket, so a diagnosis takes one window however long the path is */
+	struct ping_opts popts;
+	icmp_ping_opts_init(&popts);
+	popts.interval = opts->interval;
+	popts.log_type = PING_LOG_NONE;
+	popts.num_packets = opts->time > 0 ? -1 : opts->samples;
+	popts.on_record = _wtfpl_record;
+	popts.on_record_arg = &m;
+	if (opts->time > 0) {
+		m.deadline = time_now_ns() + (uint64_t)(opts->time * 1e9);
+		m.next_report = time_now_ns() + WTFPL_REPORT_NS;
+	}
+
+	struct ping_stats* stats = calloc(m.num, sizeof(struct ping_stats));
+	struct ping_session* session = stats ? ping_session_open(&popts) : NULL;
+	if (!session) {
+		free(stats);
+		goto done;
+	}
+	ping_session_run(session, &popts, addrs, m.num, stats);
+	ping_session_close(session);
+	free(stats);
+	_wtfpl_print(&m);
+
+	struct wtfpl_node* lastn = NULL;
+	struct wtfpl_node* first = NULL;
+	for (int i = 0; i < m.num; ++i) {
 		struct wtfpl_node* nod = calloc(1, sizeof(struct wtfpl_node));
-		nod->addr = n->in_addr;
-		nod->lost = stats.lost;
-		nod->sent = stats.sent;
-		nod->pl = stats.lost / (float)stats.sent;
+		nod->addr = m.win[i].addr;
+		nod->sent = m.win[i].count;
+		nod->lost = m.win[i].lost;
+		nod->pl = _wtfpl_pl(&m.win[i]);
+		nod->verdict = m.win[i].verdict;
 		if (lastn) lastn->next = nod;
 		if (!first) first = nod;
 		lastn = nod;
-		
-		printf(" %.2f%% PL\n", nod->pl);
-	}
-	
-	struct wtfpl_result* res = calloc(1, sizeof(struct wtfpl_result));
-	res->first = first;
-	
-	/* Determine the suspect */
-	for(struct wtfpl_node* n = first; n; n = n->next) {
-		if (n->pl > 0) {
-			res->suspect = n->addr;
-			break;
-		}
 	}
 
+	res = calloc(1, sizeof(struct wtfpl_result));
+	res->first = first;
+	res->suspect = m.suspect >= 0 ? m.win[m.suspect].addr : 0;
+	res->confirmed = m.suspect >= 0 && m.confirmed;
 	*result = res;
-	return 1;
+
+done:
+	free(rtts);
+	free(addrs);
+	free(m.win);
+	traceroute_result_free(tres);
+	return res != NULL;
 }
 
 void wtfpl_opts_init(wtfpl_opts_t* opts) {
 	opts->addr = 0;
-	opts->samples = 50;
+	opts->samples = 100;
+	opts->good_loss = 0.01;
+	opts->bad_loss = 0.1;
+	opts->interval = 0.5;
+	opts->time = 0;
 }
 
 void wtfpl_result_free(wtfpl_result_t* result) {
@@ -112,6 +331,15 @@ void wtfpl_result_free(wtfpl_result_t* result) {
 	free(result);
 }
 
+static void _wtfpl_help() {
+	printf("Usage: wtfpl [-s samples] [-i interval] [-g good%%] [-b bad%%] [-t seconds] addr\n");
+	printf("  Pings every hop to addr at once, every -i seconds (default 0.5), until a sequential test can tell\n");
+	printf("  -g%% loss (default 1) from -b%% loss (default 10) or -s packets (default 100) have been sent.\n");
+	printf("  The suspect is the first lossy hop whose loss persists at every hop after it. It is unconfirmed\n");
+	printf("  until a hop after it is found lossy too, before that it may only be rate limiting its replies.\n");
+	printf("  -t keeps monitoring for that long, loss is then over the last -s packets of each hop\n");
+}
+
 static void _wtfpl_cmd(int argc, char** argv) {
 	wtfpl_opts_t opts;
 	wtfpl_opts_init(&opts);
@@ -119,13 +347,32 @@ static void _wtfpl_cmd(int argc, char** argv) {
 	getopt_state_t st;
 	getopt_state_init(&st);
 	int opt;
-	while ((opt = getopt_s(argc, argv, "s:", &st)) != -1) {
+	while ((opt = getopt_s(argc, argv, "s:i:t:g:b:h", &st)) != -1) {
 		switch(opt) {
 		case 's':
 			opts.samples = atoi(st.optarg);
 			break;
+		case 'i':
+			opts.interval = atof(st.optarg);
+			break;
+		case 't':
+			opts.time = atof(st.optarg);
+			break;
+		case 'g':
+			opts.good_loss = atof(st.optarg) / 100;
+			break;
+		case 'b':
+			opts.bad_loss = atof(st.optarg) / 100;
+			break;
+		case 'h':
+			_wtfpl_help();
+			return;
 		}
 	}
+	if (opts.samples <= 0 || opts.interval <= 0 || opts.good_loss <= 0 || opts.bad_loss <= opts.good_loss || opts.bad_loss >= 1) {
+		_wtfpl_help();
+		return;
+	}
 
 	if (st.optind < argc)
 		opts.addr = inet_addr(argv[st.optind]);
@@ -135,9 +382,15 @@ static void _wtfpl_cmd(int argc, char** argv) {
 	}
 
 	wtfpl_result_t* result = NULL;
-	wtfpl(&opts, &result);
+	if (!wtfpl(&opts, &result))
+		return;
 	struct in_addr a = {result->suspect};
-	printf("Likely bad node: %s\n", inet_ntoa(a));
+	if (result->suspect && result->confirmed)
+		printf("Likely bad node: %s\n", inet_ntoa(a));
+	else if (result->suspect)
+		printf("Loss from %s on, unconfirmed: no hop after it was found lossy\n", inet_ntoa(a));
+	else
+		printf("No persistent loss found\n");
 	wtfpl_result_free(result);
 }
 
@@ -0,0 +1,122 @@
+/* Checks every checksum kernel in iputils.h against the scalar reference, then times them */
+#include "../src/iputils.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAX_LEN 2100
+#define MAX_OFF 64
+#define BENCH_LEN 65536
+#define BENCH_ROUNDS 20000
+
+struct kernel {
+	const char* name;
+	ip_sum64_fn fn;
+};
+
+static struct kernel kernels[] = {
+	{"generic", ip_sum64_generic},
+#ifdef IPUTILS_X86_SIMD
+	{"sse2", ip_sum64_sse2},
+	{"avx2", ip_sum64_avx2},
+#endif
+};
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static bool _kernel_usable(const struct kernel* k) {
+#ifdef IPUTILS_X86_SIMD
+	__builtin_cpu_init();
+	if (k->fn == ip_sum64_avx2)
+		return __builtin_cpu_supports("avx2");
+	if (k->fn == ip_sum64_sse2)
+		return __builtin_cpu_supports("sse2");
+#endif
+	return true;
+}
+
+/* Every length and start offset, so all tail and misalignment cases get hit */
+static int _check(const uint8_t* buf, const char* what) {
+	int failed = 0;
+	for (size_t k = 0; k < NUM_KERNELS; ++k) {
+		if (!_kernel_usable(&kernels[k]))
+			continue;
+		for (size_t off = 0; off < MAX_OFF; ++off) {
+			for (size_t len = 0; len <= MAX_LEN; ++len) {
+				uint16_t ref = ip_cksum_partial_ref(buf + off, len);
+				uint16_t got = ip_cksum_fold64(kernels[k].fn(buf + off, len));
+				if (ref != got) {
+					if (failed++ < 10)
+						printf("FAIL %s (%s): off=%zu len=%zu ref=0x%04X got=0x%04X\n", kernels[k].name, what, off, len, ref, got);
+				}
+			}
+		}
+	}
+
+	/* The dispatching entry point too */
+	for (size_t off = 0; off < MAX_OFF; ++off) {
+		for (size_t len = 0; len <= MAX_LEN; ++len) {
+			uint16_t ref = ip_cksum_partial_ref(buf + off, len);
+			uint16_t got = ip_cksum_partial(buf + off, len);
+			if (ref != got) {
+				if (failed++ < 10)
+					printf("FAIL ip_cksum_partial (%s): off=%zu len=%zu ref=0x%04X got=0x%04X\n", what, off, len, ref, got);
+			}
+		}
+	}
+	return failed;
+}
+
+static void _bench(const uint8_t* buf) {
+	for (size_t k = 0; k < NUM_KERNELS; ++k) {
+		if (!_kernel_usable(&kernels[k]))
+			continue;
+		volatile uint16_t sink = 0;
+		uint64_t start = time_now_ns();
+		for (int i = 0; i < BENCH_ROUNDS; ++i)
+			sink += ip_cksum_fold64(kernels[k].fn(buf + (i & 1), BENCH_LEN));
+		uint64_t elapsed = time_now_ns() - start;
+		printf("%-8s %.2f GB/s\n", kernels[k].name, (double)BENCH_LEN * BENCH_ROUNDS / elapsed);
+	}
+
+	volatile uint16_t sink = 0;
+	uint64_t start = time_now_ns();
+	for (int i = 0; i < BENCH_ROUNDS / 10; ++i)
+		sink += ip_cksum_partial_ref(buf + (i & 1), BENCH_LEN);
+	uint64_t elapsed = time_now_ns() - start;
+	printf("%-8s %.2f GB/s\n", "ref", (double)BENCH_LEN * (BENCH_ROUNDS / 10) / elapsed);
+}
+
+int main(int argc, char** argv) {
+	uint8_t* buf = malloc(BENCH_LEN + MAX_OFF);
+	int failed = 0;
+
+	srand(1234);
+	for (size_t i = 0; i < BENCH_LEN + MAX_OFF; ++i)
+		buf[i] = rand();
+	failed += _check(buf, "random");
+
+	/* All ones maximises carries out of every lane */
+	memset(buf, 0xFF, BENCH_LEN + MAX_OFF);
+	failed += _check(buf, "0xFF");
+
+	memset(buf, 0, BENCH_LEN + MAX_OFF);
+	failed += _check(buf, "zero");
+
+	if (failed) {
+		printf("%d mismatches\n", failed);
+		free(buf);
+		return 1;
+	}
+	printf("All checksum kernels match the reference\n");
+
+	if (argc > 1 && !strcmp(argv[1], "-b")) {
+		for (size_t i = 0; i < BENCH_LEN + MAX_OFF; ++i)
+			buf[i] = rand();
+		_bench(buf);
+	}
+	free(buf);
+	return 0;
+}
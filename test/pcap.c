@@ -65,19 +65,203 @@ static void _tr_make_icmp(struct tr_packet* packet) {
     packet->icmp_packet.icmp_cksum = ip_cksum(&packet->icmp_packet, sizeof(packet->icmp_packet));
 }
 
+/* Reads path back, whole and with its tail cut off */
+static int _check_read(const char* path, int expect, int expect_fmt) {
+	int failed = 0;
+	pcap_reader_t* r = pcap_reader_open(path);
+	if (!r || r->format != expect_fmt || r->llt != PCAP_LLT_RAWIP4) {
+		printf("FAIL %s: can't read it back\n", path);
+		pcap_reader_close(r);
+		return 1;
+	}
+
+	pcap_record_t rec;
+	int n = 0;
+	uint64_t last = 0;
+	while (pcap_reader_next(r, &rec)) {
+		const struct ip* ipf = (const struct ip*)rec.data;
+		failed += rec.caplen != sizeof(struct ip) + sizeof(struct tr_packet) || ipf->ip_ttl != 12 || rec.ts_ns < last;
+		last = rec.ts_ns;
+		++n;
+	}
+	failed += n != expect || r->truncated;
+
+	/* Random access agrees with the scan */
+	failed += pcap_reader_build_index(r) != expect;
+	for (int i = 0; i < expect; ++i)
+		failed += !pcap_reader_at(r, i, &rec) || rec.caplen != sizeof(struct ip) + sizeof(struct tr_packet);
+
+	/* Half a packet at the end, like a capture that is still being written */
+	pcap_reader_t* t = pcap_reader_open_mem(r->data, r->size - 10);
+	for (n = 0; t && pcap_reader_next(t, &rec); ++n)
+		;
+	failed += !t || n != expect - 1 || !t->truncated;
+	pcap_reader_close(t);
+	pcap_reader_close(r);
+
+	if (failed)
+		printf("FAIL %s: %d errors reading it back\n", path, failed);
+	return failed != 0;
+}
+
+/* Byte swaps the options from p on, all ours hold strings or single bytes so only code and length turn around */
+static void _swap_options(uint8_t* p, const uint8_t* end, bool usec) {
+	while (p + sizeof(pcapng_option_t) <= end) {
+		pcapng_option_t* o = (pcapng_option_t*)p;
+		const uint16_t code = o->code, len = o->len;
+		if (usec && code == PCAPNG_OPT_IF_TSRESOL)
+			p[sizeof(*o)] = 6;
+		o->code = __builtin_bswap16(code);
+		o->len = __builtin_bswap16(len);
+		if (code == PCAPNG_OPT_END)
+			break;
+		p += sizeof(*o) + PCAPNG_PAD(len);
+	}
+}
+
+/* Byte swaps a pcapng section block by block, with usec its interfaces count microseconds instead */
+static void _swap_pcapng(uint8_t* buf, size_t size, bool usec) {
+	for (size_t off = 0; off + 12 <= size;) {
+		uint32_t* b = (uint32_t*)(buf + off);
+		const uint32_t type = b[0], len = b[1];
+		size_t opts = len - 4;
+		if (type == PCAPNG_BLOCK_SHB) {
+			pcapng_shb_t* shb = (pcapng_shb_t*)b;
+			shb->byte_order = __builtin_bswap32(shb->byte_order);
+			shb->ver_major = __builtin_bswap16(shb->ver_major);
+			shb->ver_minor = __builtin_bswap16(shb->ver_minor);
+			shb->section_len = (int64_t)__builtin_bswap64((uint64_t)shb->section_len);
+			opts = sizeof(*shb);
+		}
+		else if (type == PCAPNG_BLOCK_IDB) {
+			pcapng_idb_t* idb = (pcapng_idb_t*)b;
+			idb->llt = __builtin_bswap16(idb->llt);
+			idb->reserved = __builtin_bswap16(idb->reserved);
+			idb->snl = __builtin_bswap32(idb->snl);
+			opts = sizeof(*idb);
+		}
+		else if (type == PCAPNG_BLOCK_EPB) {
+			opts = sizeof(pcapng_epb_t) + PCAPNG_PAD(b[5]);
+			if (usec) {
+				const uint64_t ts = ((uint64_t)b[3] << 32 | b[4]) / 1000;
+				b[3] = (uint32_t)(ts >> 32);
+				b[4] = (uint32_t)ts;
+			}
+			for (int i = 2; i < 7; ++i)
+				b[i] = __builtin_bswap32(b[i]);
+		}
+		_swap_options(buf + off + opts, buf + off + len - 4, usec);
+		b[0] = __builtin_bswap32(type);
+		b[1] = __builtin_bswap32(len);
+		b[len / 4 - 1] = __builtin_bswap32(len);
+		off += len;
+	}
+}
+
+/**
+ * The same capture as a big endian machine would have written it. pcapng sets the byte order per section,
+ * so there the swapped section (in microseconds, for good measure) is followed by the original and the
+ * reader has to switch in between, reading in order and through the index alike
+ */
+static int _check_swapped(const char* path) {
+	pcap_reader_t* r = pcap_reader_open(path);
+	if (!r)
+		return 1;
+	const int sections = r->format == PCAP_FORMAT_PCAPNG ? 2 : 1;
+	uint8_t* buf = malloc(r->size * sections);
+	memcpy(buf, r->data, r->size);
+	pcap_record_t rec;
+	if (r->format == PCAP_FORMAT_PCAPNG) {
+		_swap_pcapng(buf, r->size, true);
+		memcpy(buf + r->size, r->data, r->size);
+	}
+	else {
+		uint32_t* h = (uint32_t*)buf;
+		h[0] = __builtin_bswap32(h[0]);
+		((uint16_t*)buf)[2] = __builtin_bswap16(((uint16_t*)buf)[2]);
+		((uint16_t*)buf)[3] = __builtin_bswap16(((uint16_t*)buf)[3]);
+		for (int i = 2; i < 6; ++i)
+			h[i] = __builtin_bswap32(h[i]);
+		for (size_t off = sizeof(pcap_header_t); pcap_reader_next(r, &rec); off += sizeof(pcap_packet_header_t) + rec.caplen) {
+			uint32_t* ph = (uint32_t*)(buf + off);
+			for (int i = 0; i < 4; ++i)
+				ph[i] = __builtin_bswap32(ph[i]);
+		}
+	}
+
+	pcap_reader_t* s = pcap_reader_open_mem(buf, r->size * sections);
+	pcap_record_t srec;
+	int failed = !s || !s->sec.swap || s->llt != r->llt;
+	int64_t packets = 0;
+	for (int i = 0; s && i < sections; ++i) {
+		pcap_reader_rewind(r);
+		for (; pcap_reader_next(r, &rec); ++packets) {
+			const uint64_t ts = i + 1 < sections ? rec.ts_ns / 1000 * 1000 : rec.ts_ns;
+			failed += !pcap_reader_next(s, &srec) || srec.ts_ns != ts || srec.caplen != rec.caplen ||
+				memcmp(srec.data, rec.data, rec.caplen);
+		}
+	}
+	failed += s && (pcap_reader_next(s, &srec) || s->truncated);
+
+	/* Random access decodes each packet with its own section's byte order and interfaces */
+	failed += s && pcap_reader_build_index(s) != packets;
+	pcap_reader_t* seq = s ? pcap_reader_open_mem(buf, r->size * sections) : NULL;
+	for (int64_t i = 0; seq && i < packets; ++i) {
+		pcap_record_t irec;
+		failed += !pcap_reader_next(seq, &srec) || !pcap_reader_at(s, i, &irec) || irec.ts_ns != srec.ts_ns ||
+			irec.caplen != srec.caplen || irec.data != srec.data;
+	}
+	pcap_reader_close(seq);
+
+	/* Rewinding goes back to the first section's byte order */
+	if (s) {
+		pcap_reader_rewind(s);
+		pcap_reader_rewind(r);
+		failed += !pcap_reader_next(s, &srec) || !pcap_reader_next(r, &rec) || srec.ts_ns != rec.ts_ns;
+	}
+	if (failed)
+		printf("FAIL %s: byte swapped copy reads differently\n", path);
+	pcap_reader_close(s);
+	pcap_reader_close(r);
+	free(buf);
+	return failed != 0;
+}
+
 int main() {
-    pcap_file_t* pf = pcap_file_create("test.pcap", PCAP_LLT_RAWIP4);
-
-	for (int i = 0; i < 30; ++i) {
-    	struct __attribute__((packed)) packet {
-    	    struct ip ip;
-    	    struct tr_packet tr;
-    	} p = {0};
-    	_tr_make_ip_frame(&p.ip, 12, sizeof(p.tr));
-    	_tr_make_icmp(&p.tr);
-	
-    	pcap_add_packet_now(pf, &p, sizeof(p), sizeof(p));
-		usleep(1000);
+	static const struct {
+		const char* path;
+		int format;
+	} files[] = {
+		{"test.pcap", PCAP_FORMAT_USEC},
+		{"test_ns.pcap", PCAP_FORMAT_NSEC},
+		{"test.pcapng", PCAP_FORMAT_PCAPNG},
+	};
+	int failed = 0;
+
+	for (int f = 0; f < 3; ++f) {
+		pcap_opts_t opts;
+		pcap_opts_init(&opts);
+		opts.format = files[f].format;
+		pcap_file_t* pf = pcap_file_create_opts(files[f].path, PCAP_LLT_RAWIP4, &opts);
+
+		for (int i = 0; i < 30; ++i) {
+			struct __attribute__((packed)) packet {
+				struct ip ip;
+				struct tr_packet tr;
+			} p = {0};
+			_tr_make_ip_frame(&p.ip, 12, sizeof(p.tr));
+			_tr_make_icmp(&p.tr);
+
+			pcap_add_packet_comment(pf, pcap_timestamp_now(), &p, sizeof(p), sizeof(p), "test packet");
+			usleep(1000);
+		}
+		pcap_file_close(pf);
+		failed += _check_read(files[f].path, 30, files[f].format);
 	}
-    pcap_file_close(pf);
-}
\ No newline at end of file
+	failed += _check_swapped("test_ns.pcap");
+	failed += _check_swapped("test.pcapng");
+
+	if (!failed)
+		printf("All pcap files read back\n");
+	return failed != 0;
+}
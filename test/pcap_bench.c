@@ -0,0 +1,90 @@
+/* Times every pcap writer mode, usage: pcap_bench [packets] [file] */
+#define PCAP_IMPL
+#include "../src/pcap.h"
+
+#include "../src/iputils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DEFAULT_PACKETS 1000000
+#define MAX_SIZE 1500
+
+struct mode {
+	const char* name;
+	int mode;
+	int format;
+};
+
+static const struct mode modes[] = {
+	{"stdio", PCAP_WRITE_STDIO, PCAP_FORMAT_USEC},
+	{"buffered", PCAP_WRITE_BUFFERED, PCAP_FORMAT_USEC},
+	{"mmap", PCAP_WRITE_MMAP, PCAP_FORMAT_USEC},
+	{"pcapng", PCAP_WRITE_BUFFERED, PCAP_FORMAT_PCAPNG},
+};
+
+/* Ping sized packets, a typical probe and a full MTU frame */
+static const int sizes[] = {64, 128, 1500};
+
+#define ARRAY_LEN(x) (sizeof(x) / sizeof(x[0]))
+
+static int _bench(const struct mode* m, int size, long packets, const char* path, const uint8_t* data) {
+	pcap_opts_t opts;
+	pcap_opts_init(&opts);
+	opts.mode = m->mode;
+	opts.format = m->format;
+	opts.buffer_size = 4 * 1024 * 1024;
+
+	uint64_t start = time_now_ns();
+	pcap_file_t* f = pcap_file_create_opts(path, PCAP_LLT_RAWIP4, &opts);
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	pcap_timestamp_t ts = pcap_timestamp_now();
+	for (long i = 0; i < packets; ++i) {
+		ts.nsec = (ts.nsec + 1000) % 1000000000;
+		if (pcap_add_packet(f, ts, data, size, size) < 0) {
+			perror("pcap_add_packet");
+			pcap_file_close(f);
+			return 1;
+		}
+	}
+	pcap_file_close(f);
+	uint64_t elapsed = time_now_ns() - start;
+
+	/* Make sure nothing went missing on the way */
+	struct stat st;
+	long long expect = sizeof(pcap_header_t) + (long long)packets * (sizeof(pcap_packet_header_t) + size);
+	if (m->format == PCAP_FORMAT_PCAPNG) /* Section and interface blocks, then packets padded to 4 bytes */
+		expect = 44 + 32 + (long long)packets * (sizeof(pcapng_epb_t) + PCAPNG_PAD(size) + sizeof(uint32_t));
+	if (stat(path, &st) < 0 || st.st_size != expect) {
+		printf("FAIL %s size %d: file is %lld bytes, expected %lld\n", m->name, size, (long long)st.st_size, expect);
+		return 1;
+	}
+
+	printf("%-8s %5d bytes  %8.1f MB/s  %10.0f packets/s\n", m->name, size, (double)expect / elapsed * 1e3,
+		packets / (elapsed / 1e9));
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	const long packets = argc > 1 ? atol(argv[1]) : DEFAULT_PACKETS;
+	const char* path = argc > 2 ? argv[2] : "pcap_bench.pcap";
+
+	uint8_t data[MAX_SIZE];
+	for (size_t i = 0; i < sizeof(data); ++i)
+		data[i] = i;
+
+	int failed = 0;
+	for (size_t s = 0; s < ARRAY_LEN(sizes); ++s) {
+		for (size_t m = 0; m < ARRAY_LEN(modes); ++m)
+			failed += _bench(&modes[m], sizes[s], packets, path, data);
+	}
+	unlink(path);
+	return failed != 0;
+}
@@ -0,0 +1,69 @@
+/* Checks how _icmp_validate treats truncated and corrupted echo replies */
+#include "../src/ping_priv.h"
+#include "../src/iputils.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PAYLOAD 64
+
+static char expected[PAYLOAD];
+static union {
+	struct ping_packet packet;
+	char bytes[sizeof(struct ping_packet) + PAYLOAD];
+} reply;
+
+/* A reply of len bytes with a valid checksum, whatever is left of the buffer after it is stale */
+static void _make_reply(ssize_t len, char stale) {
+	memset(reply.bytes, stale, sizeof(reply.bytes));
+	memset(&reply.packet, 0, sizeof(reply.packet));
+	reply.packet.icmp.icmp_type = ICMP_ECHOREPLY;
+	memcpy(reply.packet.payload, expected, len > (ssize_t)sizeof(reply.packet) ? len - sizeof(reply.packet) : 0);
+	reply.packet.icmp.icmp_cksum = ip_cksum(&reply.packet, len);
+}
+
+static int _check(ssize_t len, bool ok, uint32_t bad_bytes, uint32_t lost_bytes) {
+	struct ping_corruption c;
+	const bool valid = _icmp_validate(expected, PAYLOAD, &reply.packet, len, &c);
+	if (valid == ok && c.bad_bytes == bad_bytes && c.lost_bytes == lost_bytes && !c.bad_cksum)
+		return 0;
+	printf("FAIL %ld byte reply: valid=%d bad_bytes=%u lost_bytes=%u bad_cksum=%d\n", (long)len, valid, c.bad_bytes,
+		c.lost_bytes, c.bad_cksum);
+	return 1;
+}
+
+int main() {
+	for (int i = 0; i < PAYLOAD; ++i)
+		expected[i] = i;
+
+	int failed = 0;
+
+	/* Cut short inside the header: nothing to compare, the whole payload is missing */
+	for (ssize_t len = ICMP_MINLEN; len < (ssize_t)sizeof(struct ping_packet); ++len) {
+		_make_reply(len, 0x55);
+		failed += _check(len, true, 0, PAYLOAD);
+	}
+
+	/* Cut short inside the payload */
+	_make_reply(sizeof(struct ping_packet) + 10, 0x55);
+	failed += _check(sizeof(struct ping_packet) + 10, true, 0, PAYLOAD - 10);
+
+	_make_reply(sizeof(reply.bytes), 0);
+	failed += _check(sizeof(reply.bytes), true, 0, 0);
+
+	/* One flipped payload byte, checksum still matching what arrived */
+	_make_reply(sizeof(reply.bytes), 0);
+	reply.packet.payload[5] ^= 0x10;
+	reply.packet.icmp.icmp_cksum = 0;
+	reply.packet.icmp.icmp_cksum = ip_cksum(&reply.packet, sizeof(reply.bytes));
+	failed += _check(sizeof(reply.bytes), false, 1, 0);
+
+	if (failed) {
+		printf("%d failures\n", failed);
+		return 1;
+	}
+	printf("Short and corrupted replies are told apart\n");
+	return 0;
+}